@@ -0,0 +1,3 @@
+  10 print "\!:\!.\|:"
+  20 goto 10
+  30 stop
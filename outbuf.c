@@ -0,0 +1,126 @@
+/* outbuf - output assembled in a large buffer and written in big blocks
+ * By Ryan Gray
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "outbuf.h"
+
+int obInit (OUTBUF *ob, FILE *out, size_t size)
+{
+    /* Returns 0 if OK, -1 if the buffer couldn't be allocated */
+
+    ob->out = out;
+    ob->len = 0;
+    ob->error = 0;
+    ob->size = size ? size : OB_SIZE;
+    ob->buf = malloc(ob->size);
+    if (ob->buf == NULL)
+        {
+        ob->size = 0;
+        ob->error = 1;
+        return -1;
+        }
+    return 0;
+}
+
+void obFree (OUTBUF *ob)
+{
+    free(ob->buf);
+    ob->buf = NULL;
+    ob->len = ob->size = 0;
+}
+
+void obFlush (OUTBUF *ob)
+{
+    /* Write out what we have. Does nothing for a memory buffer. */
+
+    if (ob->out == NULL || ob->len == 0)
+        return;
+    if (fwrite(ob->buf, 1, ob->len, ob->out) != ob->len)
+        ob->error = 1;
+    ob->len = 0;
+}
+
+static int obRoom (OUTBUF *ob, size_t n)
+{
+    /* Make room for n more bytes. Returns 0 if there's room in the buffer,
+     * 1 if the bytes are too big for it and should be written directly.
+     */
+
+    size_t want;
+    char *nbuf;
+
+    if (ob->out != NULL)
+        {
+        obFlush(ob);
+        return n > ob->size;
+        }
+    want = ob->size ? ob->size : OB_SIZE;
+    while (want < ob->len + n)
+        want *= 2;
+    nbuf = realloc(ob->buf, want);
+    if (nbuf == NULL)
+        {
+        ob->error = 1;
+        return -1;
+        }
+    ob->buf = nbuf;
+    ob->size = want;
+    return 0;
+}
+
+void obWrite (OUTBUF *ob, const char *s, size_t n)
+{
+    int r;
+
+    if (ob->len + n > ob->size)
+        {
+        r = obRoom(ob, n);
+        if (r < 0)
+            return;
+        if (r > 0)
+            {
+            if (fwrite(s, 1, n, ob->out) != n)
+                ob->error = 1;
+            return;
+            }
+        }
+    memcpy(ob->buf + ob->len, s, n);
+    ob->len += n;
+}
+
+void obPuts (OUTBUF *ob, const char *s)
+{
+    obWrite(ob, s, strlen(s));
+}
+
+void obPutc (OUTBUF *ob, char c)
+{
+    if (ob->len < ob->size)
+        ob->buf[ob->len++] = c;
+    else
+        obWrite(ob, &c, 1);
+}
+
+void obNum (OUTBUF *ob, long n, int width)
+{
+    /* Same as printf("%*ld", width, n) */
+
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+
+    do  {
+        digits[--i] = '0' + (char)(u % 10);
+        u /= 10;
+        }
+    while (u);
+    if (n < 0)
+        digits[--i] = '-';
+    while ((int)sizeof(digits) - i < width && i > 0)
+        digits[--i] = ' ';
+    obWrite(ob, digits + i, sizeof(digits) - i);
+}
@@ -0,0 +1,38 @@
+/* outbuf - output assembled in a large buffer and written in big blocks
+ * By Ryan Gray
+ *
+ * The listing tools used to printf() every character or keyword. Text is now
+ * copied into an OUTBUF and written with one fwrite() when the buffer fills or
+ * is flushed. An OUTBUF without a file keeps growing, so the whole output can
+ * be kept in memory.
+ */
+
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define OB_SIZE 65536   /* Default buffer size */
+
+typedef struct
+    {
+    char *buf;
+    size_t len;         /* Bytes in use */
+    size_t size;        /* Bytes allocated */
+    FILE *out;          /* Where to flush to, or NULL to keep it all in memory */
+    int error;          /* Set if a write or allocation failed */
+    } OUTBUF;
+
+int  obInit (OUTBUF *ob, FILE *out, size_t size);
+void obFree (OUTBUF *ob);
+void obFlush (OUTBUF *ob);
+void obWrite (OUTBUF *ob, const char *s, size_t n);
+void obPuts (OUTBUF *ob, const char *s);
+void obPutc (OUTBUF *ob, char c);
+void obNum (OUTBUF *ob, long n, int width);
+
+/* A string literal, with its length known when compiled */
+#define obLit(ob, s) obWrite((ob), (s), sizeof(s) - 1)
+
+#endif
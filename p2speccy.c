@@ -23,9 +23,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
+#include <stddef.h>
 
-#define VERSION "1.0.2"
+#ifdef __MSDOS__
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "pfile.h"
+#include "outbuf.h"
+#include "specbas.h"
+#include "p2speccy.h"
+
+#define VERSION "1.1.0"
 
 #ifdef __MSDOS__
 #define STRCMPI strcmpi
@@ -46,12 +58,15 @@
 #define K_USR       212
 #define K_CHR       214
 #define K_POWER     216
+#define K_LLIST     226
 #define K_STOP      227
 #define K_SLOW      228
 #define K_FAST      229
 #define K_SCROLL    231
 #define K_REM       234
 #define K_GOTO      236
+#define K_GOSUB     237
+#define K_LIST      240
 #define K_LET       241
 #define K_POKE      244
 #define K_PLOT      246
@@ -60,34 +75,154 @@
 #define K_UNPLOT    252
 #define K_RETURN    254
 
-unsigned char linebuf[32768]; /* Buffer to store a line of code */
-char *infile = NULL;
-char *outfile = "";
-int usr_flag = 0;       /* Flags that function was used somewhere (set in 1st pass) */
-int slow_flag = 0;
-int fast_flag = 0;
-int chr_flag = 0;
-int poke_flag = 0;
-int peek_flag = 0;
-int scroll_flag = 0;
-int inkey_flag = 0;
-int udg_flag = 0;       /* Were grey block chars used? We need to define them as UDGs */
-int udg_sub = 0;        /* Line num for UDG routine */
-int udg_sub_w = 0;      /* UDG sub has been written */
-int udg_sub_length = 3;
-int udg_call = 0;       /* Line where we will put the call to the UDG routine */
-int udg_call_w = 0;     /* Call line has been written */
-int plot_flag = 0;      /* Was a PLOT command used? We need to emit the big pixel subroutine */
-int plot_sub = 0;       /* The line number of the big-pixel PLOT subroutine */
-int plot_sub_w = 0;     /* Plot rouine written */
-int unplot_flag = 0;    /* The same for UNPLOT */
-int unplot_sub = 0;
-int unplot_sub_w = 0;
-int addStop = 0;        /* If > 0, line number of STOP to add at end of program before subroutines s*/
-long fp = 0;            /* Save file position after header is read */
-int prog_size = 0;
-int prev_k_branch = 0;  /* Was the command code of the previous line a branch or stop? */
-int prev_line = 0;      /* The previous line number */
+#define UDG_SUB_LENGTH 3    /* Lines of the UDG routine */
+char *udgModes[3] = {"basic", "code", "rem"};
+
+/* For -u rem: copies the 48 bytes after it to USR "a". Position independent,
+ * as USR enters with BC holding the address, and returns SEED in BC so the
+ * RANDOMIZE leaves it alone.
+ */
+#define UDG_REM_CODE 20
+unsigned char udg_rem[UDG_REM_CODE] =
+    {
+    0x60, 0x69,             /* LD H,B: LD L,C       */
+    0x11, 0x14, 0x00,       /* LD DE,20             */
+    0x19,                   /* ADD HL,DE            ; the data after the code */
+    0xED, 0x5B, 0x7B, 0x5C, /* LD DE,(UDG)          */
+    0x01, 0x30, 0x00,       /* LD BC,48             */
+    0xED, 0xB0,             /* LDIR                 */
+    0xED, 0x4B, 0x76, 0x5C, /* LD BC,(SEED)         */
+    0xC9                    /* RET                  */
+    };
+
+/* The grey UDGs as pairs of alternate rows, 4 rows to a pair */
+int udg_data[24] = {170,85,170,85,170,85,0,0,0,0,170,85,85,170,255,255,255,255,85,170,85,170,85,170};
+
+/* How PLOT and UNPLOT make a ZX81 pixel, which is 4x4 Spectrum pixels, and
+ * a rough estimate of the T-states each takes on a 48K Spectrum:
+ *
+ *   draw   PLOT 4*(x),4*(y) then a routine of 7 DRAWs to fill the square
+ *   print  PLOT INVERSE 1; OVER 1; to set COORDS without plotting, then a
+ *          routine that PRINTs OVER 1 the quarter block graphic for the pixel
+ *          at its character cell if POINT says it isn't already set (or is,
+ *          for UNPLOT), so the rest of the cell is kept
+ *   mc     the same PLOT, then RANDOMIZE USR an 82 byte routine in the unused
+ *          UDGs from "g" that fills or clears the 4 rows of the square
+ *
+ * The estimates are of the interpreter's work per statement and for the
+ * number and function calls, not measured.
+ */
+typedef struct
+    {
+    char *name;
+    char *plot, *plotnote;      /* Rule text and note for PLOT */
+    char *unplot, *unplotnote;  /* and UNPLOT */
+    int flags;
+    long tstates;               /* Estimated T-states per PLOT */
+    } PLOTMODE;
+PLOTMODE plotModes[3] =
+    {
+    {"draw",  " PLOT 4*(", "): GO SUB %p: REM PLOT 4x",
+              " PLOT INVERSE 1;4*(", "): GO SUB %u: REM UNPLOT 4x", 0x02, 140000L},
+    {"print", " PLOT INVERSE 1; OVER 1;", ": GO SUB %p: REM PLOT 4x",
+              " PLOT INVERSE 1; OVER 1;", ": GO SUB %u: REM UNPLOT 4x", 0, 70000L},
+    {"mc",    " PLOT INVERSE 1; OVER 1;", ": RANDOMIZE USR %m: REM PLOT 4x",
+              " PLOT INVERSE 1; OVER 1;", ": RANDOMIZE USR %n: REM UNPLOT 4x", 0, 25000L}
+    };
+
+/* The mc PLOT routine, at 65416 (UDG "g"), UNPLOT at 65420. Takes the ZX81
+ * x,y from COORDS, gives error B if it's off the ZX81's 64x44 screen, ORs
+ * (or ANDs out) the nibble for the pixel in the 4 screen rows, and returns
+ * SEED in BC so the RANDOMIZE leaves it alone.
+ */
+#define MC_ADDR     65416
+#define MC_LENGTH   82
+unsigned char mc_code[MC_LENGTH] =
+    {
+    0x1E, 0x00,             /* PLOT:   LD E,0          */
+    0x18, 0x02,             /*         JR START        */
+    0x1E, 0x01,             /* UNPLOT: LD E,1          */
+    0x2A, 0x7D, 0x5C,       /* START:  LD HL,(COORDS)  ; L=x H=y */
+    0x7C, 0xFE, 0x2C,       /*         LD A,H: CP 44   */
+    0x30, 0x42,             /*         JR NC,ERRB      */
+    0x7D, 0xFE, 0x40,       /*         LD A,L: CP 64   */
+    0x30, 0x3D,             /*         JR NC,ERRB      */
+    0x7C, 0x87, 0x87,       /*         LD A,H: ADD A,A: ADD A,A */
+    0x2F, 0xD6, 0x53,       /*         CPL: SUB 83     ; 172-4y, top row */
+    0x57,                   /*         LD D,A          */
+    0x7D, 0xCB, 0x3F,       /*         LD A,L: SRL A   ; column, Cy = x odd */
+    0x4F,                   /*         LD C,A          */
+    0x3E, 0xF0,             /*         LD A,$F0        */
+    0x30, 0x02,             /*         JR NC,LEFT      */
+    0x3E, 0x0F,             /*         LD A,$0F        */
+    0x47,                   /* LEFT:   LD B,A          ; mask */
+    0x7A, 0xE6, 0x07, 0x67, /* ROW:    LD A,D: AND 7: LD H,A */
+    0x7A, 0x1F, 0x1F, 0x1F, /*         LD A,D: RRA: RRA: RRA */
+    0xE6, 0x18, 0xB4,       /*         AND $18: OR H   */
+    0xF6, 0x40, 0x67,       /*         OR $40: LD H,A  */
+    0x7A, 0x87, 0x87,       /*         LD A,D: ADD A,A: ADD A,A */
+    0xE6, 0xE0, 0xB1, 0x6F, /*         AND $E0: OR C: LD L,A */
+    0x7B, 0xB7, 0x78,       /*         LD A,E: OR A: LD A,B */
+    0x20, 0x03,             /*         JR NZ,CLEAR     */
+    0xB6,                   /*         OR (HL)         */
+    0x18, 0x02,             /*         JR PUT          */
+    0x2F, 0xA6,             /* CLEAR:  CPL: AND (HL)   */
+    0x77,                   /* PUT:    LD (HL),A       */
+    0x14, 0x7A, 0xE6, 0x03, /*         INC D: LD A,D: AND 3 */
+    0x20, 0xDA,             /*         JR NZ,ROW       */
+    0xED, 0x4B, 0x76, 0x5C, /*         LD BC,(SEED)    */
+    0xC9,                   /*         RET             */
+    0xCF, 0x0A              /* ERRB:   RST 8: DEFB $0A ; B Integer out of range */
+    };
+
+/* For --profile, each translated line starts with POKE 23728,USR e, where e
+ * is the line's entry in a table just below the UDGs, above a RAMTOP that
+ * line 1 sets with CLEAR. Each entry is a CALL of this routine then 2 bytes
+ * for the count and 2 for the line it was last counted on (from PPC), so the
+ * count of a line that -O joins onto another still has the line it's on.
+ * It returns 0 in BC, for the POKE of the unused NMIADD system variable, so
+ * unlike RANDOMIZE USR, SEED and the rest of the statement are left alone.
+ */
+#define PROF_POKE   23728   /* NMIADD, unused on a 48K Spectrum */
+#define PROF_CODE   18
+#define PROF_ENTRY  7       /* Bytes in each line's entry */
+#define PROF_SUB_LENGTH 3   /* Lines of the routine that lists the counts */
+unsigned char prof_code[PROF_CODE] =
+    {
+    0xE1,                   /*         POP HL          ; the entry's count */
+    0x34, 0x23,             /*         INC (HL): INC HL */
+    0x20, 0x01,             /*         JR NZ,LINE      */
+    0x34,                   /*         INC (HL)        */
+    0x23,                   /* LINE:   INC HL          */
+    0xED, 0x5B, 0x45, 0x5C, /*         LD DE,(PPC)     */
+    0x73, 0x23, 0x72,       /*         LD (HL),E: INC HL: LD (HL),D */
+    0x01, 0x00, 0x00,       /*         LD BC,0         */
+    0xC9                    /*         RET             ; to USR's caller */
+    };
+
+/* For --report, the names of the flags, and where they are in a context */
+char *hit_name[H_COUNT] = {"usr", "peek", "poke", "chr", "inkey", "scroll", "udg", "plot",
+                           "unplot", "slow", "fast"};
+size_t hit_flag[H_COUNT] = {offsetof(P2SPECCY, usr_flag), offsetof(P2SPECCY, peek_flag),
+                            offsetof(P2SPECCY, poke_flag), offsetof(P2SPECCY, chr_flag),
+                            offsetof(P2SPECCY, inkey_flag), offsetof(P2SPECCY, scroll_flag),
+                            offsetof(P2SPECCY, udg_flag), offsetof(P2SPECCY, plot_flag),
+                            offsetof(P2SPECCY, unplot_flag), offsetof(P2SPECCY, slow_flag),
+                            offsetof(P2SPECCY, fast_flag)};
+#define HIT_FLAG(ctx, k) (*(int *)((char *)(ctx) + hit_flag[k]))
+
+/* For -N, the program is renumbered from 10 in 10s (or less if it's long),
+ * after the helper routines at the lowest lines so GO SUBs to them find them
+ * at once. Literal line numbers after GO TO, GO SUB, RUN, LIST and LLIST are
+ * changed, and computed ones get a warning.
+ */
+
+/* For -c, numbers in the program are written in the forms that take less
+ * room on the Spectrum than the digits and the hidden 5 byte value after
+ * them: NOT PI for 0, SGN PI for 1, CODE "c" for a printable character code,
+ * or else VAL "n". They are slower to run, so it's only worth it for a
+ * program that's short of memory.
+ */
 
 /* Define character strings for DOS Code Page 437 */
 #ifdef __MSDOS__
@@ -228,152 +363,734 @@ char *charset_read[] =
 /* 250-255 */ " IF ",  " CLS",   " UNPLOT ",  " CLEAR"," RETURN"," COPY"
 };
 
-char **charset = charset_zmb;
+/* Token classes
+ *
+ * What the passes need to know about each character code, so checkLine() and
+ * translateLine() test the same bits rather than each having their own ranges
+ * and switches. The 3 inverse "grey" block graphics are grey UDGs in the
+ * zmakebas style, but inverse characters in the readable style.
+ */
+
+#define TC_GREY     0x01    /* "Grey" block graphic, needs a UDG */
+#define TC_IGREY    0x02    /* Inverse "grey" block graphic */
+#define TC_INVERSE  0x04    /* Inverse character */
+#define TC_USR      0x08    /* Functions that get a warning */
+#define TC_CHR      0x10
+#define TC_CODE     0x20
+#define TC_INKEY    0x40
+#define TC_PEEK     0x80
+
+#define TC_WARN     (TC_USR | TC_CHR | TC_CODE | TC_INKEY | TC_PEEK)
+
+#define G    TC_GREY
+#define IG   TC_IGREY
+#define I    TC_INVERSE
+#define USR  TC_USR
+#define CHR  TC_CHR
+#define CODE TC_CODE
+#define INK  TC_INKEY
+#define PEEK TC_PEEK
+
+const unsigned char tokclass[256] =
+{
+/* 000-009 */    0,   0,   0,   0,   0,   0,   0,   0,   G,   G,
+/* 010-019 */    G,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 020-029 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 030-039 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 040-049 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 050-059 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 060-069 */    0,   0,   0,   0,   0, INK,   0,   0,   0,   0,
+/* 070-079 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 080-089 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 090-099 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 100-109 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 110-119 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 120-129 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 130-139 */    0,   0,   0,   0,   0,   0,  IG,  IG,  IG,   I,
+/* 140-149 */    I,   I,   I,   I,   I,   I,   I,   I,   I,   I,
+/* 150-159 */    I,   I,   I,   I,   I,   I,   I,   I,   I,   I,
+/* 160-169 */    I,   I,   I,   I,   I,   I,   I,   I,   I,   I,
+/* 170-179 */    I,   I,   I,   I,   I,   I,   I,   I,   I,   I,
+/* 180-189 */    I,   I,   I,   I,   I,   I,   I,   I,   I,   I,
+/* 190-199 */    I,   I,   0,   0,   0,   0,CODE,   0,   0,   0,
+/* 200-209 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 210-219 */    0,PEEK, USR,   0, CHR,   0,   0,   0,   0,   0,
+/* 220-229 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 230-239 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 240-249 */    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+/* 250-255 */    0,   0,   0,   0,   0,   0
+};
 
-/* Styles of output. Selectable by command line options. */
-enum outstyle {OUT_READABLE, OUT_ZMAKEBAS};
-enum outstyle style = OUT_ZMAKEBAS;
+#undef G
+#undef IG
+#undef I
+#undef USR
+#undef CHR
+#undef CODE
+#undef INK
+#undef PEEK
 
 char warn_ZMB[] = "\\{20}\\{1}WARNING\\{20}\\{0}"; /* Inverse video attribs for zmakebas */
 char warn_READ[] = "[WARNING]";
-char *warn;
+
+/* Rewrite rules
+ *
+ * How the ZX81 commands and functions that have no direct Spectrum version
+ * are rewritten. A command rule applies to the keyword starting a line, a
+ * function rule to the token anywhere else outside REMs and quotes. The
+ * rule's text replaces the token (or the token is kept if there is none),
+ * and its note is added at the end of the line, with %p and %u giving the
+ * lines of the PLOT and UNPLOT routines, and %m and %n the addresses of the
+ * mc PLOT and UNPLOT. Those routines are only put in the program if a rule
+ * that is used calls for them. Function notes come in the order of
+ * the rules, once per line. The built in rules come first, then any read
+ * with -R, and a later rule for a token replaces an earlier one in the
+ * dispatch tables, so translateLine() finds a token's rule by its code.
+ */
+
+#define RULE_COMMAND    0
+#define RULE_FUNCTION   1
+
+#define RF_DROP     0x01    /* Leave the line out */
+#define RF_XY       0x02    /* x,y arguments each become 4*(...) */
+#define RF_SAVE     0x04    /* Autorun LINE for an inverse end of the name, no inverse */
+#define RF_INKEY    0x08    /* Say which string variable is assigned */
+#define RF_SUBST    0x10    /* Note has % substitutions */
+
+#define RULE_PLOT   2       /* Where the PLOT and UNPLOT rules are, for -p */
+#define RULE_UNPLOT 3
+
+#define BUILTIN_RULES 12
+const RULE builtinRules[BUILTIN_RULES] =
+    {
+    {RULE_COMMAND,  K_SLOW,   NULL, NULL, RF_DROP},
+    {RULE_COMMAND,  K_FAST,   NULL, NULL, RF_DROP},
+    {RULE_COMMAND,  K_PLOT,   " PLOT 4*(", "): GO SUB %p: REM PLOT 4x", RF_XY},
+    {RULE_COMMAND,  K_UNPLOT, " PLOT INVERSE 1;4*(", "): GO SUB %u: REM UNPLOT 4x", RF_XY},
+    {RULE_COMMAND,  K_SCROLL, " POKE 23692,255: PRINT AT 21,0'': REM SCROLL", NULL, 0},
+    {RULE_COMMAND,  K_POKE,   " REM POKE ", ": REM POKE disabled! << WARNING **", 0},
+    {RULE_COMMAND,  K_SAVE,   NULL, NULL, RF_SAVE},
+    {RULE_FUNCTION, K_PEEK,   NULL, ": REM PEEK used! << WARNING **", 0},
+    {RULE_FUNCTION, K_USR,    "INT INT ", ": REM USR disabled as INT INT! << WARNING **", 0},
+    {RULE_FUNCTION, K_CHR,    NULL, ": REM CHR$ used << WARNING **", 0},
+    {RULE_FUNCTION, K_CODE,   NULL, ": REM CODE used << WARNING **", 0},
+    {RULE_FUNCTION, K_INKEY,  NULL, ": REM  INKEY$ used << WARNING ** You may need to change key comparisons to lowercase", RF_INKEY}
+    };
 
 /************************* program starts here ****************************/
 
-void getCodeLine (FILE *in, int *linenum, int *linelen, int *t)
+void useRule (P2SPECCY *ctx, int i)
+{
+    /* Put a rule in its dispatch table */
+
+    RULE *r = &ctx->rules[i];
+
+    r->textlen = r->text ? strlen(r->text) : 0;
+    r->notelen = r->note ? strlen(r->note) : 0;
+    if ( r->note && strchr(r->note, '%') )
+        r->flags |= RF_SUBST;
+    if ( r->kind == RULE_COMMAND )
+        ctx->cmdRule[r->token] = r;
+    else
+        ctx->fnRule[r->token] = r;
+}
+
+void initRules (P2SPECCY *ctx)
+{
+    /* Start with just the built in rules */
+
+    int i;
+
+    memset(ctx->cmdRule, 0, sizeof(ctx->cmdRule));
+    memset(ctx->fnRule, 0, sizeof(ctx->fnRule));
+    for (i = 0; i < BUILTIN_RULES; i++)
+        {
+        ctx->rules[i] = builtinRules[i];
+        useRule(ctx, i);
+        }
+    ctx->nrules = BUILTIN_RULES;
+}
+
+int ruleToken (const char *name)
+{
+    /* The ZX81 code for a keyword or function name, or a number.
+     * Returns -1 if it's not one.
+     */
+
+    int c;
+    const char *s, *e;
+    char word[16];
+
+    if ( isdigit((unsigned char)name[0]) )
+        {
+        c = atoi(name);
+        return c < 256 ? c : -1;
+        }
+    for (c = 64; c < 256; c++)
+        {
+        if ( c == 67 )
+            c = 192; /* Only RND, INKEY$, PI and 192 up are tokens */
+        for (s = charset_read[c]; *s == ' '; s++)
+            ;
+        for (e = s + strlen(s); e > s && e[-1] == ' '; e--)
+            ;
+        if ( e - s >= (int)sizeof(word) )
+            continue;
+        memcpy(word, s, e - s);
+        word[e - s] = '\0';
+        if ( STRCMPI(word, name) == 0 )
+            return c;
+        }
+    return -1;
+}
+
+char *ruleField (char **p)
+{
+    /* Next field of a rule line: a word, or a string in double quotes with
+     * "" for a quote. Returns NULL at the end of the line.
+     */
+
+    char *s = *p, *start, *d;
+
+    while ( *s == ' ' || *s == '\t' )
+        s++;
+    if ( *s == '\0' || *s == '\n' || *s == '\r' )
+        return NULL;
+    if ( *s == '"' )
+        {
+        start = d = ++s;
+        while ( *s && *s != '\n' && *s != '\r' )
+            {
+            if ( *s == '"' && s[1] != '"' )
+                {
+                s++;
+                break;
+                }
+            if ( *s == '"' )
+                s++;
+            *d++ = *s++;
+            }
+        }
+    else
+        {
+        start = s;
+        while ( *s && !isspace((unsigned char)*s) )
+            s++;
+        d = s;
+        if ( *s )
+            s++;
+        }
+    *p = s;
+    *d = '\0';
+    return start;
+}
+
+int loadRules (P2SPECCY *ctx, const char *name)
 {
-    /* Get a single ZX81 program line.
-     * Line number into linenum, length into linelen, and line into linebuf
+    /* Add the rules in a file, one to a line:
+     *
+     *   command|function token text note [flags]
+     *
+     * where token is a ZX81 keyword or code, text and note are in quotes or
+     * - for none, and the flags are any of drop, xy, save and inkey.
+     * Returns 0 if OK, -1 if not.
      */
 
-    int b1, b2, f;
+    FILE *in;
+    char line[1024], *p, *f[4], *flag, *copy;
+    int n = 0, i, bad;
+    RULE *r;
+
+    in = fopen(name, "rt");
+    if ( in == NULL )
+        {
+        fprintf(stderr, "Error: couldn't open rule file '%s'\n", name);
+        return -1;
+        }
+    while ( fgets(line, sizeof(line), in) != NULL )
+        {
+        n++;
+        p = line;
+        for (i = 0; i < 4; i++)
+            {
+            f[i] = ruleField(&p);
+            if ( f[i] == NULL || (i == 0 && f[0][0] == '#') )
+                break;
+            }
+        if ( i == 0 || (f[0] && f[0][0] == '#') )
+            continue; /* Blank or comment */
+        bad = i < 4 || ctx->nrules == MAX_RULES;
+        r = &ctx->rules[ctx->nrules];
+        if ( !bad )
+            {
+            r->kind = STRCMPI(f[0], "command") == 0 ? RULE_COMMAND : RULE_FUNCTION;
+            bad = r->kind == RULE_FUNCTION && STRCMPI(f[0], "function") != 0;
+            r->token = ruleToken(f[1]);
+            bad = bad || r->token < 0;
+            r->flags = 0;
+            r->text = r->note = NULL;
+            for (i = 2; i < 4 && !bad; i++)
+                {
+                if ( strcmp(f[i], "-") == 0 )
+                    continue;
+                copy = malloc(strlen(f[i]) + 1);
+                if ( copy == NULL )
+                    bad = 1;
+                else
+                    strcpy(copy, f[i]);
+                if ( i == 2 )
+                    r->text = copy;
+                else
+                    r->note = copy;
+                }
+            while ( !bad && (flag = ruleField(&p)) != NULL )
+                {
+                if ( STRCMPI(flag, "drop") == 0 )       r->flags |= RF_DROP;
+                else if ( STRCMPI(flag, "xy") == 0 )    r->flags |= RF_XY;
+                else if ( STRCMPI(flag, "save") == 0 )  r->flags |= RF_SAVE;
+                else if ( STRCMPI(flag, "inkey") == 0 ) r->flags |= RF_INKEY;
+                else bad = 1;
+                }
+            }
+        if ( bad )
+            {
+            fprintf(stderr, "%s:%d: bad rule\n", name, n);
+            fclose(in);
+            return -1;
+            }
+        useRule(ctx, ctx->nrules++);
+        }
+    fclose(in);
+    return 0;
+}
+
+void ruleNote (P2SPECCY *ctx, OUTBUF *ob, const RULE *r)
+{
+    /* Write a rule's note, with the routine lines put in */
+
+    const char *s;
+
+    if ( !(r->flags & RF_SUBST) )
+        {
+        obWrite(ob, r->note, r->notelen);
+        return;
+        }
+    for (s = r->note; *s; s++)
+        {
+        if ( *s != '%' || s[1] == '\0' )
+            obPutc(ob, *s);
+        else if ( *++s == 'p' )
+            obNum(ob, ctx->plot_sub, 0);
+        else if ( *s == 'u' )
+            obNum(ob, ctx->unplot_sub, 0);
+        else if ( *s == 'm' )
+            obNum(ob, MC_ADDR, 0);
+        else if ( *s == 'n' )
+            obNum(ob, MC_ADDR + 4, 0);
+        else
+            obPutc(ob, *s);
+        }
+}
 
-    b1 = fgetc(in);
-    b2 = fgetc(in);
-    *linenum = b1 * 256 + b2;
-    (*t) -= 2;
+void ruleCalls (P2SPECCY *ctx, const RULE *r)
+{
+    /* Note the routines a rule that is used calls for in its note */
 
-    b1 = fgetc(in);
-    b2 = fgetc(in);
-    *linelen = b1 + 256 * b2;
-    (*t) -= 2;
+    const char *s;
 
-    for (f = 0; f < *linelen; f++)
+    if ( r == NULL || !(r->flags & RF_SUBST) )
+        return;
+    for (s = r->note; *s; s++)
         {
-        linebuf[f] = fgetc(in);
-        (*t)--;
+        if ( *s != '%' || s[1] == '\0' )
+            continue;
+        switch (*++s)
+            {
+            case 'p':   ctx->plot_call = 1;     break;
+            case 'u':   ctx->unplot_call = 1;   break;
+            case 'm':
+            case 'n':   ctx->mc_call = 1;       break;
+            default:    break;
+            }
         }
 }
 
-void checkForSubs (int linenum)
+void checkForSubs (P2SPECCY *ctx, int linenum)
 {
     /* Check for places we can put the subroutines or calls we might need to insert */
 
     int addedAnything = 0;
-    int next_line = prev_line + 1;
+    int next_line = ctx->prev_line + 1;
 
-    if ( !udg_call && linenum > next_line )
+    if ( !ctx->udg_call && linenum > next_line )
         {
-        udg_call = next_line++;
+        ctx->udg_call = next_line++;
         }
 
-    if ( linenum > 9999 && !prev_k_branch ) 
+    if ( linenum > 9999 && !ctx->prev_k_branch ) 
         {
         /* After end of program, and it didn't end with an unconditional branch,
          * so we might have to insert a stop to put routines after.
          */
-        addStop = next_line++;
-        prev_k_branch = 1; /* To allow the following checks to be done */
+        ctx->addStop = next_line++;
+        ctx->prev_k_branch = 1; /* To allow the following checks to be done */
         }
 
-    if ( prev_k_branch ) /* Previous line was an unconditional branch or stop */
+    if ( ctx->prev_k_branch ) /* Previous line was an unconditional branch or stop */
         {
         /* We could safely put a subroutine here.
          * Check if any routines still need a location
          * We assume we need them even if we don't later
          */
 
-        if ( !plot_sub && linenum > next_line )
+        if ( !ctx->plot_sub && linenum > next_line )
+            {
+            ctx->plot_sub = next_line++;
+            addedAnything = 1;
+            }
+        if ( !ctx->unplot_sub && linenum > next_line )
             {
-            plot_sub = next_line++;
+            ctx->unplot_sub = next_line++; 
             addedAnything = 1;
             }
-        if ( !unplot_sub && linenum > next_line )
+        if ( ctx->plot_mode == PLOT_MC && !ctx->mc_sub && linenum >= next_line + 2 )
             {
-            unplot_sub = next_line++; 
+            ctx->mc_sub = next_line;
+            next_line += 2;
             addedAnything = 1;
             }
-        if ( !udg_sub && linenum >= next_line + udg_sub_length )
+        if ( !ctx->udg_sub && linenum >= next_line + UDG_SUB_LENGTH + 1 )
             {
-            udg_sub = next_line;
-            next_line += udg_sub_length; 
+            ctx->udg_sub = next_line;
+            next_line += UDG_SUB_LENGTH + 1; /* It has a DATA line after */
+            addedAnything = 1;
+            }
+        if ( ctx->profile && !ctx->prof_sub && linenum >= next_line + PROF_SUB_LENGTH )
+            {
+            ctx->prof_sub = next_line;
+            next_line += PROF_SUB_LENGTH;
             addedAnything = 1;
             }
         if (!addedAnything)
-            addStop = 0;
+            ctx->addStop = 0;
+        }
+}
+
+int udgByte (int i)
+{
+    /* Byte i of the grey UDGs: the DATA gives 2 rows for each 4 */
+
+    return udg_data[(i / 4) * 2 + (i & 1)];
+}
+
+void writePrintSub (P2SPECCY *ctx, OUTBUF *ob, const char *test)
+{
+    /* The PRINT for -p print: the quarter block for the pixel at COORDS, or a
+     * space if test is 0, printed OVER 1 at its character cell.
+     */
+
+    obLit(ob, " PRINT OVER 1;AT 21-INT (PEEK 23678/2),INT (PEEK 23677/2);\" ");
+    if ( ctx->style == OUT_READABLE )
+        {
+        obLit(ob, BLL);
+        obLit(ob, BLR);
+        obLit(ob, BUL);
+        obLit(ob, BUR);
+        }
+    else
+        obLit(ob, "\\. \\ .\\' \\ '");
+    obLit(ob, "\"(1+");
+    obPuts(ob, test);
+    obLit(ob, "*(1+PEEK 23677-2*INT (PEEK 23677/2)+2*(PEEK 23678-2*INT (PEEK 23678/2))));");
+}
+
+void setPlotMode (P2SPECCY *ctx, enum plotmode m)
+{
+    /* Set the PLOT and UNPLOT rules for a way of drawing the pixels */
+
+    PLOTMODE *p = &plotModes[m];
+
+    ctx->plot_mode = m;
+    ctx->rules[RULE_PLOT].text = p->plot;
+    ctx->rules[RULE_PLOT].note = p->plotnote;
+    ctx->rules[RULE_PLOT].flags = p->flags;
+    ctx->rules[RULE_UNPLOT].text = p->unplot;
+    ctx->rules[RULE_UNPLOT].note = p->unplotnote;
+    ctx->rules[RULE_UNPLOT].flags = p->flags;
+    if ( ctx->cmdRule[K_PLOT] == &ctx->rules[RULE_PLOT] )
+        useRule(ctx, RULE_PLOT);
+    if ( ctx->cmdRule[K_UNPLOT] == &ctx->rules[RULE_UNPLOT] )
+        useRule(ctx, RULE_UNPLOT);
+}
+
+void writeProfileInit (P2SPECCY *ctx, OUTBUF *ob)
+{
+    /* The --profile setup at the start of line 1: the routine from the DATA
+     * after the listing routine, then a CALL of it and zero counts in each
+     * entry. The CLEAR, which empties the GO SUB stack, keeps them above
+     * RAMTOP, and comes first as the machine stack is below RAMTOP.
+     */
+
+    long e = ctx->prof_base + PROF_CODE;
+    long last = e + PROF_ENTRY * (ctx->prof_n - 1);
+
+    obLit(ob, " CLEAR ");
+    obNum(ob, ctx->prof_base - 1, 0);
+    obLit(ob, ": RESTORE ");
+    obNum(ob, ctx->prof_sub + 2, 0);
+    obLit(ob, ": FOR a=");
+    obNum(ob, ctx->prof_base, 0);
+    obLit(ob, " TO ");
+    obNum(ob, e - 1, 0);
+    obLit(ob, ": READ b: POKE a,b: NEXT a: FOR a=");
+    obNum(ob, e, 0);
+    obLit(ob, " TO ");
+    obNum(ob, last, 0);
+    obLit(ob, " STEP ");
+    obNum(ob, PROF_ENTRY, 0);
+    obLit(ob, ": POKE a,205: POKE a+1,");
+    obNum(ob, ctx->prof_base & 255, 0);
+    obLit(ob, ": POKE a+2,");
+    obNum(ob, ctx->prof_base >> 8, 0);
+    obLit(ob, ": FOR b=3 TO 6: POKE a+b,0: NEXT b: NEXT a");
+}
+
+void writeProfileSub (P2SPECCY *ctx, OUTBUF *ob)
+{
+    /* The --profile routine to run with GO TO after the program: the line
+     * and count of each entry that was counted, then the routine's DATA */
+
+    long e = ctx->prof_base + PROF_CODE;
+    int f;
+
+    obNum(ob, ctx->prof_sub, 4);
+    obLit(ob, " PRINT \"Line\",\"Hits\": FOR a=");
+    obNum(ob, e, 0);
+    obLit(ob, " TO ");
+    obNum(ob, e + PROF_ENTRY * (ctx->prof_n - 1), 0);
+    obLit(ob, " STEP ");
+    obNum(ob, PROF_ENTRY, 0);
+    obLit(ob, ": IF PEEK (a+3)+PEEK (a+4) THEN PRINT PEEK (a+5)+256*PEEK (a+6),PEEK (a+3)+256*PEEK (a+4)\n");
+    obNum(ob, ctx->prof_sub+1, 4);
+    obLit(ob, " NEXT a: STOP: REM Profile\n");
+    obNum(ob, ctx->prof_sub+2, 4);
+    obLit(ob, " DATA ");
+    for (f = 0; f < PROF_CODE; f++)
+        {
+        obNum(ob, prof_code[f], 0);
+        obPutc(ob, f < PROF_CODE - 1 ? ',' : '\n');
+        }
+}
+
+void writeUdgCall (P2SPECCY *ctx, OUTBUF *ob, int mc)
+{
+    /* The rest of the line at the start that sets up the UDGs and the mc PLOT
+     * code */
+
+    int f;
+
+    if ( ctx->udg_flag && ctx->udg_mode == UDG_BASIC )
+        {
+        obLit(ob, " GO SUB ");
+        obNum(ob, ctx->udg_sub, 0);
+        if ( mc )
+            obLit(ob, ":");
+        else
+            obLit(ob, ": REM Grey UDGs\n");
+        }
+    if ( mc )
+        {
+        /* Before any IF or REM for the UDGs, which end the line */
+        obLit(ob, " GO SUB ");
+        obNum(ob, ctx->mc_sub, 0);
+        if ( ctx->udg_flag && ctx->udg_mode != UDG_BASIC )
+            obLit(ob, ":");
+        else
+            obLit(ob, ": REM PLOT code\n");
+        }
+    if ( ctx->udg_flag && ctx->udg_mode == UDG_CODE )
+        {
+        /* Unless they're still there from a previous run */
+        obLit(ob, " IF PEEK USR \"a\"<>");
+        obNum(ob, udg_data[0], 0);
+        obLit(ob, " THEN LOAD \"\"CODE USR \"a\",48: REM Grey UDGs\n");
+        }
+    if ( ctx->udg_flag && ctx->udg_mode == UDG_REM )
+        {
+        /* The REM ends the line, just before NXTLIN */
+        obLit(ob, " RANDOMIZE USR (PEEK 23637+256*PEEK 23638-");
+        obNum(ob, UDG_REM_CODE + 48 + 1, 0);
+        obLit(ob, "): REM ");
+        for (f = 0; f < UDG_REM_CODE + 48; f++)
+            {
+            obLit(ob, "\\{");
+            obNum(ob, f < UDG_REM_CODE ? udg_rem[f] : udgByte(f - UDG_REM_CODE), 0);
+            obPutc(ob, '}');
+            }
+        obPutc(ob, '\n');
         }
 }
 
-void writeSubs (FILE *out, int linenum)
+void writeSubs (P2SPECCY *ctx, OUTBUF *ob, int linenum)
 {
     /* Check if we need to write any routines before the next line */
 
-    if ( udg_flag && udg_call && !udg_call_w && linenum > udg_call )
+    int f;
+
+    int mc = ctx->mc_call;
+    int udg = (ctx->udg_flag || mc) && !ctx->udg_preset;
+
+    if ( (udg || ctx->prof_n) && ctx->udg_call && !ctx->udg_call_w && linenum > ctx->udg_call )
+        {
+        obNum(ob, ctx->udg_call, 4);
+        if ( ctx->prof_n )
+            {
+            writeProfileInit(ctx, ob);
+            if ( udg )
+                obLit(ob, ":");
+            else
+                obLit(ob, ": REM Profile\n");
+            }
+        if ( udg )
+            writeUdgCall(ctx, ob, mc);
+        ctx->udg_call_w = 1;
+        }
+    if ( ctx->jump_line && !ctx->jump_line_w && linenum > ctx->jump_line )
+        {
+        obNum(ob, ctx->jump_line, 4);
+        obLit(ob, " GO TO ");
+        obNum(ob, ctx->renum_new[0], 0);
+        obLit(ob, "\n");
+        ctx->jump_line_w = 1;
+        }
+    if ( ctx->addStop && linenum > ctx->addStop )
+        {
+        obNum(ob, ctx->addStop, 4);
+        obLit(ob, " STOP\n");
+        ctx->addStop = 0;
+        }
+    if ( ctx->plot_mode == PLOT_PRINT )
         {
-        fprintf(out, "%4d GO SUB %d: REM Grey UDGs\n", udg_call, udg_sub);
-        udg_call_w = 1;
+        if ( ctx->plot_call && ctx->plot_sub && !ctx->plot_sub_w && linenum > ctx->plot_sub )
+            {
+            obNum(ob, ctx->plot_sub, 4);
+            writePrintSub(ctx, ob, "(NOT POINT (4*PEEK 23677,4*PEEK 23678))");
+            obLit(ob, ": RETURN: REM Plot 4x pixel\n");
+            ctx->plot_sub_w = 1;
+            }
+        if ( ctx->unplot_call && ctx->unplot_sub && !ctx->unplot_sub_w && linenum > ctx->unplot_sub )
+            {
+            obNum(ob, ctx->unplot_sub, 4);
+            writePrintSub(ctx, ob, "POINT (4*PEEK 23677,4*PEEK 23678)");
+            obLit(ob, ": RETURN: REM Unplot 4x pixel\n");
+            ctx->unplot_sub_w = 1;
+            }
         }
-    if ( addStop && linenum > addStop )
+    if ( ctx->plot_mode == PLOT_DRAW )
         {
-        fprintf(out, "%4d STOP\n", addStop);
-        addStop = 0;
+        if ( ctx->plot_call && ctx->plot_sub && !ctx->plot_sub_w && linenum > ctx->plot_sub )
+            {
+            obNum(ob, ctx->plot_sub, 4);
+            obLit(ob, " DRAW 3,0: DRAW 0,3: DRAW -3,0: DRAW 0,-2: DRAW 2,0: DRAW 0,1: DRAW -1,0: RETURN: REM Plot 4x pixel\n");
+            ctx->plot_sub_w = 1;
+            }
+        if ( ctx->unplot_call && ctx->unplot_sub && !ctx->unplot_sub_w && linenum > ctx->unplot_sub )
+            {
+            obNum(ob, ctx->unplot_sub, 4);
+            obLit(ob, " DRAW INVERSE 1;3,0: DRAW INVERSE 1;0,3: DRAW INVERSE 1;-3,0: DRAW INVERSE 1;0,-2: DRAW INVERSE 1;2,0: DRAW INVERSE 1;0,1: DRAW INVERSE 1;-1,0: RETURN: REM Unplot 4x pixel\n");
+            ctx->unplot_sub_w = 1;
+            }
         }
-    if ( plot_flag )
+    if ( mc && ctx->mc_sub && !ctx->mc_sub_w && linenum > ctx->mc_sub && !ctx->udg_preset )
         {
-        if ( plot_sub && !plot_sub_w && linenum > plot_sub )
+        obNum(ob, ctx->mc_sub, 4);
+        obLit(ob, " RESTORE ");
+        obNum(ob, ctx->mc_sub+1, 0);
+        obLit(ob, ": FOR A=");
+        obNum(ob, MC_ADDR, 0);
+        obLit(ob, " TO ");
+        obNum(ob, MC_ADDR + MC_LENGTH - 1, 0);
+        obLit(ob, ": READ B: POKE A,B: NEXT A: RETURN: REM PLOT code\n");
+        obNum(ob, ctx->mc_sub+1, 4);
+        obLit(ob, " DATA ");
+        for (f = 0; f < MC_LENGTH; f++)
             {
-            fprintf(out, "%4d DRAW 3,0: DRAW 0,3: DRAW -3,0: DRAW 0,-2: DRAW 2,0: DRAW 0,1: DRAW -1,0: RETURN: REM Plot 4x pixel\n", plot_sub);
-            plot_sub_w = 1;
+            obNum(ob, mc_code[f], 0);
+            obPutc(ob, f < MC_LENGTH - 1 ? ',' : '\n');
             }
-        if ( unplot_sub && !unplot_sub_w && linenum > unplot_sub )
+        ctx->mc_sub_w = 1;
+        }
+    if ( ctx->udg_flag && ctx->udg_sub && ! ctx->udg_sub_w && linenum > ctx->udg_sub && ctx->udg_mode == UDG_BASIC && !ctx->udg_preset )
+        {
+        obNum(ob, ctx->udg_sub, 4);
+        obLit(ob, " RESTORE ");
+        obNum(ob, ctx->udg_sub+3, 0);
+        obLit(ob, ": LET U=USR \"a\": REM Init grey UDGs\n");
+        obNum(ob, ctx->udg_sub+1, 4);
+        obLit(ob, " FOR A=0 TO 47 STEP 4: READ B,C\n");
+        obNum(ob, ctx->udg_sub+2, 4);
+        obLit(ob, " POKE U+A,B: POKE U+A+1,C: POKE U+A+2,B: POKE U+A+3,C: NEXT A: RETURN\n");
+        obNum(ob, ctx->udg_sub+3, 4);
+        obLit(ob, " DATA ");
+        for (f = 0; f < 24; f++)
             {
-            fprintf(out, "%4d DRAW INVERSE 1;3,0: DRAW INVERSE 1;0,3: DRAW INVERSE 1;-3,0: DRAW INVERSE 1;0,-2: DRAW INVERSE 1;2,0: DRAW INVERSE 1;0,1: DRAW INVERSE 1;-1,0: RETURN: REM Unplot 4x pixel\n", unplot_sub);
-            unplot_sub_w = 1;
+            obNum(ob, udg_data[f], 0);
+            obPutc(ob, f < 23 ? ',' : '\n');
             }
+        ctx->udg_sub_w = 1;
         }
-    if ( udg_flag && udg_sub && ! udg_sub_w && linenum > udg_sub )
+    if ( ctx->prof_n && ctx->prof_sub && !ctx->prof_sub_w && linenum > ctx->prof_sub )
         {
-        fprintf(out, "%4d RESTORE %d: LET U=USR \"a\": REM Init grey UDGs\n", udg_sub, udg_sub+3);
-        fprintf(out, "%4d FOR A=0 TO 47 STEP 4: READ B,C\n", udg_sub+1);
-        fprintf(out, "%4d POKE U+A,B: POKE U+A+1,C: POKE U+A+2,B: POKE U+A+3,C: NEXT A: RETURN\n", udg_sub+2);
-        fprintf(out, "%4d DATA 170,85,170,85,170,85,0,0,0,0,170,85,85,170,255,255,255,255,85,170,85,170,85,170\n", udg_sub+3);
-        udg_sub_w = 1;
+        writeProfileSub(ctx, ob);
+        ctx->prof_sub_w = 1;
         }
 
 }
 
-void checkLine (int linelen, int linenum)
+void noteHit (P2SPECCY *ctx, int kind, int linenum)
+{
+    /* Set a flag, and for a report, note the line it was set on */
+
+    HITS *h = &ctx->hits[kind];
+    int *more;
+
+    HIT_FLAG(ctx, kind) = 1;
+    if ( ctx->report == REPORT_NONE || (h->n > 0 && h->lines[h->n-1] == linenum) )
+        return;
+    if ( h->n == h->size )
+        {
+        more = realloc(h->lines, (h->size ? h->size * 2 : 16) * sizeof(int));
+        if ( more == NULL )
+            return; /* Just the flag then */
+        h->lines = more;
+        h->size = h->size ? h->size * 2 : 16;
+        }
+    h->lines[h->n++] = linenum;
+}
+
+void checkLine (P2SPECCY *ctx, const unsigned char *text, int linelen, int linenum)
 {
     /* Check a line for tokens of interest to set their presence flags */
 
-    int f, inQuotes = 0;
-    unsigned char c, keyword = linebuf[0];
+    int f, t, inQuotes = 0;
+    unsigned char c, keyword = linelen > 0 ? text[0] : 0;
 
     if ( keyword != K_REM )
-        prev_k_branch = 0;
+        ctx->prev_k_branch = 0;
+    ruleCalls(ctx, ctx->cmdRule[keyword]);
 
     switch (keyword)
         {
-        case K_SLOW:    slow_flag = 1;  return;
-        case K_FAST:    fast_flag = 1;  return;
-        case K_PLOT:    plot_flag = 1;  return;
-        case K_UNPLOT:  unplot_flag = 1;return;
-        case K_SCROLL:  scroll_flag = 1;return;
-        case K_POKE:    poke_flag = 1;  return;
+        case K_SLOW:    noteHit(ctx, H_SLOW, linenum);   return;
+        case K_FAST:    noteHit(ctx, H_FAST, linenum);   return;
+        case K_PLOT:    noteHit(ctx, H_PLOT, linenum);   return;
+        case K_UNPLOT:  noteHit(ctx, H_UNPLOT, linenum); return;
+        case K_SCROLL:  noteHit(ctx, H_SCROLL, linenum); return;
+        case K_POKE:    noteHit(ctx, H_POKE, linenum);   return;
         case K_STOP:
         case K_GOTO:
         case K_RETURN:
-        case K_RUN:     prev_k_branch = 1; /* We can possibly insert a subroutine after this line */
+        case K_RUN:     ctx->prev_k_branch = 1; /* We can possibly insert a subroutine after this line */
                         return;
         default:        break;
         }
@@ -382,57 +1099,253 @@ void checkLine (int linelen, int linenum)
 
     for (f = 0; f < linelen - 1; f++)
         {
-        c = linebuf[f]; /* Character code  */
+        c = text[f];    /* Character code  */
 
         if ( c == K_NUMBER ) f += 5;  /* avoid inline FP numbers */
 
         if ( (keyword != K_REM) && (c == K_QUOTE) ) inQuotes = !inQuotes;
 
-        if ( (c >= 8 && c <= 10) || ( c >= 136 && c <= 138) ) /* Grey block graphics used */
+        if ( f > 0 && keyword != K_REM && !inQuotes )
+            ruleCalls(ctx, ctx->fnRule[c]);
+
+        t = tokclass[c];
+        if ( t & (TC_GREY | TC_IGREY) ) /* Grey block graphics used */
             {
-            udg_flag = 1;
+            noteHit(ctx, H_UDG, linenum);
             }
-        else if (keyword != K_REM && !inQuotes ) /* Only if these are not in REMs or quotes */
+        else if ( (t & TC_WARN) && keyword != K_REM && !inQuotes ) /* Only if these are not in REMs or quotes */
             {
-            switch (c)
-                {
-                case K_USR:     usr_flag   = 1; break;
-                case K_CHR:
-                case K_CODE:    chr_flag   = 1; break;
-                case K_INKEY:   inkey_flag = 1; break;
-                case K_PEEK:    peek_flag  = 1; break;
-                }
+            if ( t & TC_USR )               noteHit(ctx, H_USR, linenum);
+            if ( t & (TC_CHR | TC_CODE) )   noteHit(ctx, H_CHR, linenum);
+            if ( t & TC_INKEY )             noteHit(ctx, H_INKEY, linenum);
+            if ( t & TC_PEEK )              noteHit(ctx, H_PEEK, linenum);
             }
         }
 }
 
-void translateLine (FILE *out, int linelen, int linenum)
+int mapLine (P2SPECCY *ctx, long old)
+{
+    /* The new number for a line, or for the line a GO TO old would find:
+     * the first at or after it. Past the end is past the new end.
+     */
+
+    long lo = 0, hi = ctx->renum_n, mid;
+
+    while ( lo < hi )
+        {
+        mid = (lo + hi) / 2;
+        if ( ctx->renum_lines[mid].num < old )
+            lo = mid + 1;
+        else
+            hi = mid;
+        }
+    if ( lo == ctx->renum_n )
+        return ctx->renum_new[ctx->renum_n-1] < 9999 ? ctx->renum_new[ctx->renum_n-1] + 1 : 9999;
+    return ctx->renum_new[lo];
+}
+
+void compactNumber (P2SPECCY *ctx, OUTBUF *ob, const char *s, int n, int alone)
+{
+    /* Write the number text s of n characters in its shortest form, adding
+     * the bytes saved to compact_line. NOT has a low priority, so NOT PI is
+     * only used when the number is alone between separators.
+     */
+
+    long v = 0;
+    int i, cost = n + 6; /* The digits, 0x0E and 5 bytes */
+
+    for (i = 0; i < n && i < 6 && s[i] >= '0' && s[i] <= '9'; i++)
+        v = v * 10 + (s[i] - '0');
+    if ( i == n && v == 0 && alone )
+        {
+        obLit(ob, "NOT PI");
+        ctx->compact_line += cost - 2;
+        }
+    else if ( i == n && v == 1 )
+        {
+        obLit(ob, "SGN PI");
+        ctx->compact_line += cost - 2;
+        }
+    else if ( i == n && v >= 32 && v < 127 && strchr("\"\\`[]", (int)v) == NULL )
+        {
+        obLit(ob, "CODE \"");
+        obPutc(ob, (char)v);
+        obPutc(ob, '"');
+        ctx->compact_line += cost - 4;
+        }
+    else
+        {
+        obLit(ob, "VAL \"");
+        obWrite(ob, s, n);
+        obPutc(ob, '"');
+        ctx->compact_line += cost - (n + 3);
+        }
+}
+
+int numberEnd (const unsigned char *text, int f, int linelen)
+{
+    /* If a number starts at f, rather than digits in a name, return where
+     * its hidden value is, else 0.
+     */
+
+    int e = f;
+
+    if ( f > 1 && text[f-1] >= 27 && text[f-1] <= 63 )
+        return 0; /* After a letter, digit or point */
+    while ( e < linelen - 1 && ((text[e] >= 27 && text[e] <= 37) ||
+            (text[e] == 42 && e > f) ||                      /* E */
+            ((text[e] == 21 || text[e] == 22) && text[e-1] == 42)) )  /* + - */
+        e++;
+    return e > f && text[e] == K_NUMBER ? e : 0;
+}
+
+int compactLiteral (P2SPECCY *ctx, OUTBUF *ob, const unsigned char *text, int f, int e, int linelen)
+{
+    /* Write the number from f to its hidden value at e with compactNumber(),
+     * and return where it ends.
+     */
+
+    static const char numchars[] = ".0123456789";
+    char s[32];
+    int n = 0, alone;
+    unsigned char p = text[f-1], c = text[e+6];
+
+    /* Next to , ( ) ; = AT TAB THEN TO STEP or the keyword or end of line */
+    alone = (f == 1 || p == K_COMMA || p == K_LPAREN || p == 25 || p == 20 ||
+             p == 193 || p == 194 || p == 223 || p == 224) &&
+            (e + 6 >= linelen - 1 || c == K_COMMA || c == K_RPAREN || c == 25 ||
+             c == 222 || c == 223 || c == 224);
+    for ( ; f < e && n < (int)sizeof(s); f++)
+        {
+        if ( text[f] >= 27 && text[f] <= 37 )
+            s[n++] = numchars[text[f] - 27];
+        else
+            s[n++] = text[f] == 42 ? 'E' : text[f] == 21 ? '+' : '-';
+        }
+    compactNumber(ctx, ob, s, n, alone);
+    return e + 5;
+}
+
+int renumTarget (P2SPECCY *ctx, OUTBUF *ob, const unsigned char *text, int f, int linelen, int *computed)
+{
+    /* After a GO TO etc. at f, if what follows to the end of the line is a
+     * number, write its new line and return where it ends, else note that
+     * it's computed and return f.
+     */
+
+    int e = f + 1, line, n;
+    char s[8];
+
+    while ( e < linelen - 1 && ((text[e] >= 28 && text[e] <= 37) || text[e] == 27) )
+        e++; /* Digits and point */
+    if ( e == f + 1 || text[e] != K_NUMBER || e + 6 != linelen - 1 )
+        {
+        if ( e < linelen - 1 )
+            *computed = 1;
+        return f; /* No number, as RUN alone, or more than one */
+        }
+    line = mapLine(ctx, (long)(pfileNumber(text + e + 1) + 0.5));
+    if ( ctx->compact )
+        {
+        n = sprintf(s, "%d", line);
+        compactNumber(ctx, ob, s, n, 1);
+        }
+    else
+        obNum(ob, line, 0);
+    return e + 5;
+}
+
+int renumberLayout (P2SPECCY *ctx, const PLINE *lines, long nlines, int *newnums)
+{
+    /* Put the helper routines the first pass found are needed at the lowest
+     * lines, behind a GO TO to the program, and number the program lines
+     * after them. Returns 0 if OK, -1 if there are too many lines.
+     */
+
+    int next = 1, base, step = 10, mc, subs;
+    long i;
+
+    mc = ctx->mc_call && !ctx->udg_preset;
+    ctx->udg_call = ctx->plot_sub = ctx->unplot_sub = ctx->mc_sub = ctx->udg_sub = ctx->addStop = ctx->jump_line = 0;
+    ctx->prof_sub = 0;
+    subs = ((ctx->plot_call || ctx->unplot_call) && ctx->plot_mode != PLOT_MC) || mc ||
+           (ctx->udg_flag && ctx->udg_mode == UDG_BASIC && !ctx->udg_preset) || ctx->profile;
+    if ( ((ctx->udg_flag || mc) && !ctx->udg_preset) || ctx->profile )
+        ctx->udg_call = next++;
+    if ( subs )
+        ctx->jump_line = next++;
+    if ( ctx->plot_call && ctx->plot_mode != PLOT_MC )
+        ctx->plot_sub = next++;
+    if ( ctx->unplot_call && ctx->plot_mode != PLOT_MC )
+        ctx->unplot_sub = next++;
+    if ( mc )
+        {
+        ctx->mc_sub = next;
+        next += 2;
+        }
+    if ( ctx->udg_flag && ctx->udg_mode == UDG_BASIC && !ctx->udg_preset )
+        {
+        ctx->udg_sub = next;
+        next += UDG_SUB_LENGTH + 1; /* It has a DATA line after */
+        }
+    if ( ctx->profile )
+        {
+        ctx->prof_sub = next;
+        next += PROF_SUB_LENGTH;
+        }
+
+    base = (next + 9) / 10 * 10;
+    if ( nlines > 1 && base + step * (nlines - 1) > 9999 )
+        step = (9999 - base) / (nlines - 1);
+    if ( step < 1 )
+        return -1;
+    for (i = 0; i < nlines; i++)
+        newnums[i] = base + step * (int)i;
+    return 0;
+}
+
+void translateLine (P2SPECCY *ctx, OUTBUF *ob, const unsigned char *text, int linelen, int linenum)
 {
     /* Translate line into words and characters using the charset array,
-     * applying any translation transforms.
+     * applying any rewrite rules.
      */
 
-    int f, inQuotes = 0, inInverse = 0;
-    unsigned char c, keyword = linebuf[0];
+    int f, t, i, j, inQuotes = 0, inInverse = 0;
+    unsigned char c, keyword = linelen > 0 ? text[0] : 0;
     char *x;
+    int xlen;
     int parens   = 0; /* Track parens level */
     int comma    = 0; /* Handled comma between x,y of PLOT */
-    int usr_p    = 0; /* Set flags for post note to print */
-    int chr_p    = 0;
-    int code_p   = 0;
-    int peek_p   = 0;
-    int inkey_p  = 0;
-    int plot_p   = ( keyword == K_PLOT );
-    int unplot_p = ( keyword == K_UNPLOT );
-
-    if ( keyword == K_SLOW || keyword == K_FAST ) return; /* Just remove these */
-
-    fprintf(out, "%4d", linenum);
+    const RULE *cmd = ctx->cmdRule[keyword];
+    const RULE *fn;
+    int xy_p     = cmd && (cmd->flags & RF_XY);
+    int save_p   = cmd && (cmd->flags & RF_SAVE);
+    const RULE *used[MAX_RULES]; /* Function rules to add the notes of */
+    int nused    = 0;
+    int computed = 0; /* A line number that can't be renumbered */
+    int e, remark;   /* remark if a rule makes the line a REM */
+
+    if ( cmd && (cmd->flags & RF_DROP) ) return; /* Just remove these */
+
+    remark = keyword == K_REM ||
+             (cmd && cmd->text && strncmp(cmd->text + strspn(cmd->text, " "), "REM", 3) == 0);
+    ctx->compact_line = 0;
+    obNum(ob, ctx->renum_n ? mapLine(ctx, linenum) : linenum, 4);
+    if ( ctx->prof_n )
+        {
+        obLit(ob, " POKE ");
+        obNum(ob, PROF_POKE, 0);
+        obLit(ob, ",USR ");
+        obNum(ob, ctx->prof_base + PROF_CODE + PROF_ENTRY * ctx->prof_next++, 0);
+        obPutc(ob, ':');
+        }
 
     for (f = 0; f < linelen - 1; f++)
         {
-        c = linebuf[f]; /* Character code  */
-        x = charset[c]; /* Translated code */
+        c = text[f];        /* Character code  */
+        x = ctx->charset[c];     /* Translated code */
+        xlen = ctx->charlen[c];
+        t = tokclass[c];    /* What sort it is */
 
         if ( c == K_NUMBER )
             {
@@ -442,24 +1355,12 @@ void translateLine (FILE *out, int linelen, int linenum)
         else if ( f == 0 ) /* On the keyword character */
             {
             /* Things to modify only when a command */
-            switch (keyword)
-                {
-                case K_PLOT:
-                    fprintf(out, " PLOT 4*(");
-                    break;
-                case K_UNPLOT:
-                    fprintf(out, " PLOT INVERSE 1;4*(");
-                    break;
-                case K_SCROLL:
-                    fprintf(out, " POKE 23692,255: PRINT AT 21,0'': REM SCROLL");
-                    break;
-                case K_POKE:
-                    fprintf(out, " REM POKE ");
-                    break;
-                default:
-                    fprintf(out, "%s", x); /* Print translated char */
-                    break;
-                }
+            if ( cmd && cmd->text )
+                obWrite(ob, cmd->text, cmd->textlen);
+            else
+                obWrite(ob, x, xlen); /* Print translated char */
+            if ( ctx->renum_n && (c == K_GOTO || c == K_GOSUB || c == K_RUN || c == K_LIST || c == K_LLIST) )
+                f = renumTarget(ctx, ob, text, f, linelen, &computed);
             }
         else
             {
@@ -468,66 +1369,85 @@ void translateLine (FILE *out, int linelen, int linenum)
             if ( !inQuotes && c == K_LPAREN ) parens++;
             if ( !inQuotes && c == K_RPAREN ) parens--;
 
-            if (inInverse && ( c < (139-3*(style==OUT_READABLE)) || c > 191) )
+            if ( inInverse && !(t & ctx->tc_inverse) )
                 {
                 /* Non-inverse character - discontinue inverse mode if on */
                 inInverse = 0;
-                if ( style == OUT_ZMAKEBAS )
-                    fprintf(out, "\\{20}\\{0}");
+                if ( ctx->style == OUT_ZMAKEBAS )
+                    obLit(ob, "\\{20}\\{0}");
                 else
-                    fprintf(out, "]");
+                    obLit(ob, "]");
                 }
 
-            if ( (plot_p || unplot_p) && !inQuotes && parens == 0 && !comma && c == K_COMMA )
+            if ( xy_p && !inQuotes && parens == 0 && !comma && c == K_COMMA )
                 {
                 /* The comma separating the x,y values in plot or unplot command */
                 comma = 1;
-                fprintf(out, "),4*(");
+                obLit(ob, "),4*(");
+                }
+            else if ( ctx->compact && !remark && !inQuotes && (e = numberEnd(text, f, linelen)) > 0 )
+                {
+                f = compactLiteral(ctx, ob, text, f, e, linelen);
                 }
-            else if ( (c >= 8 && c <= 10) || ( style==OUT_ZMAKEBAS && c >= 136 && c <= 138) ) /* Grey block graphics character */
+            else if ( t & ctx->tc_grey ) /* Grey block graphics character */
                 {
-                fprintf(out, "%s", x);
+                obWrite(ob, x, xlen);
                 }
-            else if ( c >= (139-3*(style==OUT_READABLE)) && c <= 191) /* Inverse character */
+            else if ( t & ctx->tc_inverse ) /* Inverse character */
                 {
-                if ( keyword == K_SAVE ) /* Don't switch to inverse mode */
+                if ( save_p ) /* Don't switch to inverse mode */
                     {
-                    fprintf(out, "%s", x);
+                    obWrite(ob, x, xlen);
                     }
                 else if (inInverse)
-                    fprintf(out, "%s", x); /* continue in inverse */
+                    obWrite(ob, x, xlen); /* continue in inverse */
                 else
                     {
                     /* Switch to inverse mode */
                     inInverse = 1;
-                    if ( style == OUT_ZMAKEBAS )
-                        fprintf(out, "\\{20}\\{1}%s", x);
+                    if ( ctx->style == OUT_ZMAKEBAS )
+                        {
+                        obLit(ob, "\\{20}\\{1}");
+                        obWrite(ob, x, xlen);
+                        }
                     else
-                        fprintf(out, "[%s", x);
+                        {
+                        obPutc(ob, '[');
+                        obWrite(ob, x, xlen);
+                        }
                     }
                 }
-            else if ( keyword != K_REM && !inQuotes ) /* Only if used */
+            else if ( keyword != K_REM && !inQuotes && (fn = ctx->fnRule[c]) != NULL )
                 {
-                if ( c == K_USR )
-                    {
-                    fprintf(out, "INT INT "); /* Disable by replacing with distinct pattern when a function */
-                    usr_p = 1;
-                    }
+                if ( fn->text )
+                    obWrite(ob, fn->text, fn->textlen);
                 else
+                    obWrite(ob, x, xlen); /* Print translated char */
+                if ( fn->note )
                     {
-                    fprintf(out, "%s", x); /* Print translated char */
-                    if (c == K_PEEK)        peek_p  = 1;
-                    else if (c == K_CHR)    chr_p   = 1;
-                    else if (c == K_CODE)   code_p  = 1;
-                    else if (c == K_INKEY)  inkey_p = 1;
+                    /* Keep the notes in rule order, each once */
+                    for (i = 0; i < nused && used[i] < fn; i++)
+                        ;
+                    if ( i == nused || used[i] != fn )
+                        {
+                        for (j = nused++; j > i; j--)
+                            used[j] = used[j-1];
+                        used[i] = fn;
+                        }
                     }
                 }
+            else if ( ctx->renum_n && keyword != K_REM && !inQuotes &&
+                      (c == K_GOTO || c == K_GOSUB || c == K_RUN || c == K_LIST || c == K_LLIST) )
+                {
+                obWrite(ob, x, xlen); /* After a THEN */
+                f = renumTarget(ctx, ob, text, f, linelen, &computed);
+                }
             else
                 {
                 if ( c == K_POWER && (keyword == K_REM || inQuotes) )
-                    fprintf(out, "**"); /* Print stars instead of ^ */
+                    obLit(ob, "**"); /* Print stars instead of ^ */
                 else /* Nothing special */
-                    fprintf(out, "%s", x); /* Print translated char */
+                    obWrite(ob, x, xlen); /* Print translated char */
                 }
             }
         }
@@ -536,146 +1456,1022 @@ void translateLine (FILE *out, int linelen, int linenum)
         {
         /* End of line - discontinue inverse mode if on */
         inInverse = 0;
-        if ( style == OUT_ZMAKEBAS )
-            fprintf(out, "\\{20}\\{0}");
+        if ( ctx->style == OUT_ZMAKEBAS )
+            obLit(ob, "\\{20}\\{0}");
         else
-            fprintf(out, "]");
+            obLit(ob, "]");
         }
 
     /* Append any post stuff needed */
 
-    if ( keyword == K_SAVE ) /* Check for autorun SAVE */
+    if ( save_p ) /* Check for autorun SAVE */
         {
-        if ( linebuf[linelen-2] == K_QUOTE ) /* Literal filename */
+        if ( linelen >= 3 && text[linelen-2] == K_QUOTE ) /* Literal filename */
             {
-            c = linebuf[linelen-3];
+            c = text[linelen-3];
             if ( c >= 128 ) /* Inverted last char of filename = autosave */
-                fprintf(out, " LINE %d", linenum+1);
+                {
+                if ( ctx->prof_n )
+                    ctx->autorun_line = ctx->udg_call; /* Must set up the counts first */
+                else
+                    ctx->autorun_line = ctx->renum_n ? mapLine(ctx, linenum+1) : linenum+1;
+                obLit(ob, " LINE ");
+                obNum(ob, ctx->autorun_line, 0);
+                }
             }
         }
-    else if ( keyword == K_POKE )   fprintf(out, ": REM POKE disabled! << WARNING **");
-    else if ( keyword == K_PLOT )   fprintf(out, "): GO SUB %d: REM PLOT 4x", plot_sub);
-    else if ( keyword == K_UNPLOT ) fprintf(out, "): GO SUB %d: REM UNPLOT 4x", unplot_sub);
+    if ( cmd && cmd->note )
+        ruleNote(ctx, ob, cmd);
+    if ( computed )
+        obLit(ob, ": REM Computed line number not renumbered! << WARNING **");
 
-    if ( peek_p )   fprintf(out, ": REM PEEK used! << WARNING **");
-    if ( usr_p )    fprintf(out, ": REM USR disabled as INT INT! << WARNING **");
-    if ( chr_p )    fprintf(out, ": REM CHR$ used << WARNING **");
-    if ( code_p )   fprintf(out, ": REM CODE used << WARNING **");
-    if ( inkey_p )  
+    for (i = 0; i < nused; i++)
         {
-        fprintf(out, ": REM  INKEY$ used << WARNING ** You may need to change key comparisons to lowercase");
-        if ( keyword == K_LET && linebuf[2] == K_DOLLAR) /* Assigned to a string var */
-            fprintf(out, " with %s$.", charset[linebuf[1]]);
-        else
-            fprintf(out, ".");
-        }
+        ruleNote(ctx, ob, used[i]);
+        if ( used[i]->flags & RF_INKEY )
+            {
+            if ( keyword == K_LET && linelen > 3 && text[2] == K_DOLLAR) /* Assigned to a string var */
+                {
+                obLit(ob, " with ");
+                obPuts(ob, ctx->charset[text[1]]);
+                obLit(ob, "$.");
+                }
+            else
+                obLit(ob, ".");
+            }
+        }
 
-    fprintf(out, "\n");
+    obLit(ob, "\n");
+
+    if ( ctx->compact_line )
+        {
+        fprintf(stderr, "Line %d: -c saved %d bytes\n", ctx->renum_n ? mapLine(ctx, linenum) : linenum, ctx->compact_line);
+        ctx->compact_lines++;
+        ctx->compact_saved += ctx->compact_line;
+        }
 }
 
-void checkFile (FILE *in, int *linenum)
+void checkFile (P2SPECCY *ctx, const PLINE *lines, long nlines)
 {
-    /* check (opened) .P file for needed extra routines */
+    /* check the program lines for needed extra routines */
 
-    int b1, b2;
-    int f, linelen, d_file, total;
-
-    for (f = 1; f <= 3; f++)
-        fgetc(in);   /* ignore sys vars */
-    b1 = fgetc(in); b2=fgetc(in);           /* except d_file */
-    d_file = b1 + 256 * b2;
-    for (f = 1; f <= 111; f++)
-        fgetc(in); /* ignore more sys vars */
-    fp = ftell(in); /* Save where program starts in the file */
-    prog_size = d_file - 16509; /* if d_file is after, prog is 16509 to d_file-1 right? */
-    total = prog_size;
+    long i;
 
     /* First pass to scout for subroutine locations and what xforms the code needs */
 
-    getCodeLine(in, linenum, &linelen, &total); /* Get first line */
+    if ( nlines <= 0 )
+        return;
     /* Check space before 1st line for UDG call */
-    if ( *linenum > 1 ) udg_call = 1; /* Put it at line 1*/
+    if ( lines[0].num > 1 ) ctx->udg_call = 1; /* Put it at line 1*/
+
+    for (i = 0; i < nlines; i++)
+        {
+        checkForSubs(ctx, lines[i].num);                              /* Can we put a subroutine before this line? */
+        checkLine(ctx, lines[i].text, lines[i].len, lines[i].num);    /* Check line for issues */
+        ctx->prev_line = lines[i].num;
+        }
+    checkForSubs(ctx, 20000); /* Any subroutines left unplaced can go after the last line */
+}
+
+/* process the program lines to the output */
+
+void processFile (P2SPECCY *ctx, const PLINE *lines, long nlines, OUTBUF *ob)
+{
+    long i;
 
-    while (total >= 0) /* run through 'total' bytes */
+    /* run through the program again, interpreting the lines */
+    for (i = 0; i < nlines; i++)
         {
-        checkForSubs(*linenum);         /* Can we put a subroutine before this line? */
-        checkLine(linelen, *linenum);   /* Check line for issues */
-        prev_line = *linenum;
-        getCodeLine(in, linenum, &linelen, &total);   /* Get next line */
+        writeSubs(ctx, ob, ctx->renum_n ? ctx->renum_new[i] : lines[i].num);
+        /* Write the line */
+        translateLine(ctx, ob, lines[i].text, lines[i].len, lines[i].num);
+        ctx->prev_line = lines[i].num;
         }
-    checkForSubs(20000); /* Any subroutines left unplaced can go after the last line */
+    writeSubs(ctx, ob, 20000);
+    if ( ctx->compact )
+        fprintf(stderr, "-c saved %ld bytes on %d lines\n", ctx->compact_saved, ctx->compact_lines);
+    if ( ctx->prof_n )
+        fprintf(stderr, "--profile: GO TO %d after a run lists the hits on each line\n", ctx->prof_sub);
+}
+
+/* -O makes a pass over the translated text. Lines that are only a REM are
+ * removed and lines that nothing jumps to are joined onto the line before. A
+ * GO TO or GO SUB to a line that is a GO TO goes straight to where that goes,
+ * a GO SUB followed by a RETURN becomes a GO TO, and SCROLL scrolls with the
+ * ROM routine rather than a POKE and two newlines. A REM line with a
+ * warning, like a POKE that was taken out, is kept. A jump goes to the first
+ * line at or after its number, so removing a line doesn't change where it
+ * goes, but joining a line a jump goes to would, so nothing is joined if any
+ * jump has a line number that's worked out when it runs.
+ */
+typedef struct
+    {
+    int num;
+    char *text;         /* The line after its number, with no newline */
+    int len;
+    int target;         /* A jump with a literal line number goes here */
+    int drop;           /* Removed, or joined onto the line before */
+    } OLINE;
+
+#define MAX_JOINED  200     /* Longest line text to make by joining */
+
+/* Rough T-states on a 48K Spectrum, for the estimate of the time saved */
+#define T_NEWLINE   700     /* Going on to the next line rather than the next statement */
+#define T_REMLINE   900     /* Running a line that's only a REM */
+#define T_JUMP      2500    /* A GO TO with a literal line, besides finding the line */
+#define T_RETURN    2000    /* A RETURN */
+#define T_POKE      3500    /* The POKE 23692,255 of a SCROLL */
+#define T_FINDLINE  80      /* Passing a line when finding the line to jump to */
+
+enum jumpword {J_GOTO, J_GOSUB, J_RUN, J_LIST, J_LLIST, J_RESTORE, J_SAVE, J_COUNT};
+const char *jumpWords[J_COUNT] = {"GO TO", "GO SUB", "RUN", "LIST", "LLIST", "RESTORE", "SAVE"};
+
+const char scrollOld[] = " POKE 23692,255: PRINT AT 21,0'': REM SCROLL";
+const char scrollNew[] = " PRINT AT 21,0;: IF USR 3582 THEN REM SCROLL";
+
+int startsWord (const char *s, int i, int end, const char *word)
+{
+    /* Does the keyword word start at s[i], before end? */
+
+    int n = strlen(word);
+
+    return i + n <= end && strncmp(s + i, word, n) == 0 &&
+           (i + n == end || !(isalnum((unsigned char)s[i+n]) || s[i+n] == '$'));
 }
 
-/* process (opened) .P file to stdout */
+int statementEnd (const char *s, int len, int i)
+{
+    /* Where the statement at i ends, at a : or THEN outside quotes or the end
+     * of the line. A REM runs to the end of the line.
+     */
+
+    int q = 0;
 
-void processFile (FILE *in, FILE *out)
+    if ( startsWord(s, i, len, "REM") )
+        return len;
+    for ( ; i < len; i++)
+        {
+        if ( s[i] == '"' )
+            q = !q;
+        else if ( !q && (s[i] == ':' || (s[i] == 'T' && s[i-1] == ' ' && startsWord(s, i, len, "THEN"))) )
+            return i;
+        }
+    return len;
+}
+
+int nextStatement (const char *s, int len, int *pos, int *end)
 {
-    int linelen, linenum, total;
+    /* Find the statement from *pos, skipping spaces, and set *end to where
+     * it ends and *pos to the next one. Returns where it starts, or -1 at
+     * the end of the line.
+     */
+
+    int i = *pos;
 
-    /* Go back to start of program */
-    fseek(in, fp, SEEK_SET);
+    while ( i < len && s[i] == ' ' )
+        i++;
+    if ( i >= len )
+        return -1;
+    *end = statementEnd(s, len, i);
+    *pos = *end == len ? len : *end + (s[*end] == ':' ? 1 : 4);
+    return i;
+}
+
+int jumpArg (const char *s, int i, int end, int *arg)
+{
+    /* If the statement from i to end is a jump, or a SAVE with a LINE, set
+     * *arg to where its line number starts and return which it is, else -1.
+     */
 
-    total = prog_size;
+    int w, q = 0;
 
-    /* run through 'total' bytes, interpreting them as ZX81 program lines */
-    getCodeLine(in, &linenum, &linelen, &total);
-    while (total >= 0)
+    for (w = 0; w < J_COUNT && !startsWord(s, i, end, jumpWords[w]); w++)
+        ;
+    if ( w == J_COUNT )
+        return -1;
+    i += strlen(jumpWords[w]);
+    if ( w == J_SAVE )
         {
-        writeSubs(out, linenum);
-        /* Write the line */
-        translateLine(out, linelen, linenum);
-        prev_line = linenum;
-        getCodeLine(in, &linenum, &linelen, &total);
+        for ( ; i < end && (q || !startsWord(s, i, end, "LINE")); i++)
+            if ( s[i] == '"' )
+                q = !q;
+        if ( i == end )
+            return -1;
+        i += 4;
+        }
+    while ( i < end && s[i] == ' ' )
+        i++;
+    *arg = i;
+    return w;
+}
+
+long lineLiteral (const char *s, int i, int end)
+{
+    /* The line number from s[i] to end, in any of the forms -c writes, or -1
+     * if it's worked out when it runs.
+     */
+
+    long v = 0;
+    int n;
+
+    while ( end > i && s[end-1] == ' ' )
+        end--;
+    if ( end - i == 6 && strncmp(s + i, "NOT PI", 6) == 0 )
+        return 0;
+    if ( end - i == 6 && strncmp(s + i, "SGN PI", 6) == 0 )
+        return 1;
+    if ( end - i == 8 && strncmp(s + i, "CODE \"", 6) == 0 && s[i+7] == '"' )
+        return (unsigned char)s[i+6];
+    if ( end - i > 6 && strncmp(s + i, "VAL \"", 5) == 0 && s[end-1] == '"' )
+        {
+        i += 5;
+        end--;
+        }
+    for (n = i; n < end && n - i < 5 && s[n] >= '0' && s[n] <= '9'; n++)
+        v = v * 10 + (s[n] - '0');
+    return n == end && n > i ? v : -1;
+}
+
+long findLine (const OLINE *ol, long n, long num)
+{
+    /* The first line at or after num, or n if none */
+
+    long lo = 0, hi = n, mid;
+
+    while ( lo < hi )
+        {
+        mid = (lo + hi) / 2;
+        if ( ol[mid].num < num )
+            lo = mid + 1;
+        else
+            hi = mid;
+        }
+    return lo;
+}
+
+int replaceText (OLINE *l, int from, int to, const char *s, int n)
+{
+    /* Replace the text of a line from from to to with n characters of s.
+     * Returns 0 if OK, -1 if out of memory.
+     */
+
+    char *t = malloc(l->len - (to - from) + n + 1);
+
+    if ( t == NULL )
+        return -1;
+    memcpy(t, l->text, from);
+    memcpy(t + from, s, n);
+    memcpy(t + from + n, l->text + to, l->len - to + 1);
+    free(l->text);
+    l->text = t;
+    l->len += n - (to - from);
+    return 0;
+}
+
+int optimizeText (P2SPECCY *ctx, const OUTBUF *in, OUTBUF *ob)
+{
+    /* Optimize the translated program text in, writing it to ob, and report
+     * what was done on stderr. Returns 0 if OK, -1 if out of memory.
+     */
+
+    OLINE *ol;
+    OUTBUF num;
+    long n = 0, i, k, last, v, to;
+    int pos, st, end, arg, ke, karg, w, depth, computed = 0, r = 0;
+    int rems = 0, joins = 0, jumps = 0, tails = 0, scrolls = 0;
+    const char *p = in->buf, *e = in->buf + in->len, *nl;
+    char *t, digits[24];
+
+    for (nl = p; nl < e; nl++)
+        n += *nl == '\n';
+    ol = calloc(n ? n : 1, sizeof(OLINE));
+    if ( ol == NULL || obInit(&num, NULL, 16) != 0 )
+        {
+        free(ol);
+        return -1;
+        }
+
+    /* Each line is a number in 4 columns then its text */
+    for (n = 0; p < e; p = nl + 1, n++)
+        {
+        nl = memchr(p, '\n', e - p);
+        if ( nl == NULL )
+            nl = e;
+        ol[n].num = atoi(p);
+        p += nl - p > 4 ? 4 : nl - p;
+        ol[n].len = nl - p;
+        ol[n].text = malloc(ol[n].len + 1);
+        if ( ol[n].text == NULL )
+            {
+            r = -1;
+            break;
+            }
+        memcpy(ol[n].text, p, ol[n].len);
+        ol[n].text[ol[n].len] = '\0';
+        }
+
+    for (i = 0; i < n && r == 0; i++)
+        {
+        /* SCROLL with the ROM routine that scrolls the whole screen */
+        if ( ol[i].len >= (int)sizeof(scrollOld) - 1 &&
+             strcmp(ol[i].text + ol[i].len - (sizeof(scrollOld) - 1), scrollOld) == 0 )
+            {
+            r = replaceText(&ol[i], ol[i].len - (sizeof(scrollOld) - 1), ol[i].len,
+                            scrollNew, sizeof(scrollNew) - 1);
+            scrolls++;
+            }
+
+        /* Send a GO TO or GO SUB to a GO TO to where that goes */
+        pos = 0;
+        while ( r == 0 && (st = nextStatement(ol[i].text, ol[i].len, &pos, &end)) >= 0 )
+            {
+            w = jumpArg(ol[i].text, st, end, &arg);
+            if ( (w != J_GOTO && w != J_GOSUB) || (v = lineLiteral(ol[i].text, arg, end)) < 0 )
+                continue;
+            to = v;
+            for (depth = 0; depth < 8; depth++)
+                {
+                k = findLine(ol, n, to);
+                if ( k == n || k == i )
+                    break;
+                st = strspn(ol[k].text, " ");
+                ke = statementEnd(ol[k].text, ol[k].len, st);
+                if ( jumpArg(ol[k].text, st, ke, &karg) != J_GOTO ||
+                     (v = lineLiteral(ol[k].text, karg, ke)) < 0 || v == to )
+                    break;
+                to = v;
+                }
+            if ( to != lineLiteral(ol[i].text, arg, end) )
+                {
+                while ( end > arg && ol[i].text[end-1] == ' ' )
+                    end--;
+                num.len = 0;
+                w = sprintf(digits, "%ld", to);
+                if ( ctx->compact )
+                    compactNumber(ctx, &num, digits, w, 1);
+                else
+                    obWrite(&num, digits, w);
+                r = replaceText(&ol[i], arg, end, num.buf, (int)num.len);
+                pos = 0;    /* Start over, as the text has moved */
+                jumps++;
+                }
+            }
+        }
+
+    /* Find which lines are jumped to */
+    for (i = 0; i < n && r == 0; i++)
+        {
+        pos = 0;
+        while ( (st = nextStatement(ol[i].text, ol[i].len, &pos, &end)) >= 0 )
+            {
+            if ( jumpArg(ol[i].text, st, end, &arg) < 0 || arg == end )
+                continue; /* Not a jump, or RUN, LIST or RESTORE alone */
+            v = lineLiteral(ol[i].text, arg, end);
+            if ( v < 0 )
+                computed = 1;
+            else if ( (k = findLine(ol, n, v)) < n )
+                ol[k].target = 1;
+            }
+        }
+
+    /* Remove REM lines and join lines onto the one before */
+    last = -1;
+    for (i = 0; i < n && r == 0; i++)
+        {
+        t = ol[i].text + strspn(ol[i].text, " ");
+        if ( !ol[i].target && startsWord(t, 0, ol[i].len, "REM") && strstr(t, "<< WARNING") == NULL )
+            {
+            ol[i].drop = 1;
+            rems++;
+            continue;
+            }
+        if ( last >= 0 && !computed && !ol[i].target &&
+             ol[last].len + ol[i].len + 1 <= MAX_JOINED )
+            {
+            /* Not onto an IF, whose later statements are only run if it's
+             * true, a REM or DATA, or a line that doesn't go on to the next
+             * one, which would make the joined line only reachable by a jump
+             * to its old number */
+            pos = 0;
+            w = 1;
+            arg = -1;
+            while ( w && (st = nextStatement(ol[last].text, ol[last].len, &pos, &end)) >= 0 )
+                {
+                w = !startsWord(ol[last].text, st, end, "IF") &&
+                    !startsWord(ol[last].text, st, end, "REM") &&
+                    !startsWord(ol[last].text, st, end, "DATA");
+                if ( end == ol[last].len )
+                    {
+                    ke = jumpArg(ol[last].text, st, end, &karg);
+                    if ( ke == J_GOSUB )
+                        arg = st; /* Ends with a GO SUB */
+                    else if ( ke == J_GOTO || ke == J_RUN ||
+                              startsWord(ol[last].text, st, end, "RETURN") ||
+                              startsWord(ol[last].text, st, end, "STOP") )
+                        w = 0;
+                    }
+                }
+            if ( w && arg >= 0 && strcmp(t, "RETURN") == 0 )
+                {
+                /* GO SUB then RETURN is GO TO */
+                r = replaceText(&ol[last], arg, arg + 6, "GO TO", 5);
+                ol[i].drop = 1;
+                tails++;
+                continue;
+                }
+            if ( w )
+                {
+                t = realloc(ol[last].text, ol[last].len + ol[i].len + 2);
+                if ( t == NULL )
+                    {
+                    r = -1;
+                    break;
+                    }
+                ol[last].text = t;
+                t[ol[last].len++] = ':';
+                memcpy(t + ol[last].len, ol[i].text, ol[i].len + 1);
+                ol[last].len += ol[i].len;
+                ol[i].drop = 1;
+                joins++;
+                continue;
+                }
+            }
+        last = i;
+        }
+
+    for (i = 0; i < n && r == 0; i++)
+        {
+        if ( ol[i].drop )
+            continue;
+        obNum(ob, ol[i].num, 4);
+        obWrite(ob, ol[i].text, ol[i].len);
+        obPutc(ob, '\n');
+        }
+    if ( r == 0 )
+        {
+        fprintf(stderr, "-O removed %d REM lines, joined %d lines, shortened %d jumps, "
+                "made %d GO SUBs GO TOs and %d SCROLLs faster\n",
+                rems, joins, jumps, tails, scrolls);
+        fprintf(stderr, "-O saves about %ld T-states running each line once, and up to %ld "
+                "finding a line to jump to\n",
+                (long)rems * T_REMLINE + (long)joins * T_NEWLINE + (long)jumps * T_JUMP +
+                (long)tails * T_RETURN + (long)scrolls * T_POKE,
+                (long)(rems + joins + tails) * T_FINDLINE);
+        }
+
+    for (i = 0; i < n; i++)
+        free(ol[i].text);
+    free(ol);
+    obFree(&num);
+    return r;
+}
+
+void setStyle (P2SPECCY *ctx, enum outstyle s)
+{
+    /* Set up the tables for an output style */
+
+    int c;
+
+    ctx->style = s;
+    if ( ctx->style == OUT_READABLE )
+        {
+        ctx->charset = charset_read;
+        ctx->warn = warn_READ;
+        ctx->tc_grey = TC_GREY;
+        ctx->tc_inverse = TC_INVERSE | TC_IGREY;
+        }
+    else
+        {
+        ctx->charset = charset_zmb;
+        ctx->warn = warn_ZMB;
+        ctx->tc_grey = TC_GREY | TC_IGREY;
+        ctx->tc_inverse = TC_INVERSE;
+        }
+    for (c = 0; c < 256; c++)
+        ctx->charlen[c] = strlen(ctx->charset[c]);
+}
+
+void p2sInit (P2SPECCY *ctx)
+{
+    /* Set up a context with the defaults, as with no options */
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->udg_mode = UDG_BASIC;
+    ctx->plot_mode = PLOT_DRAW;
+    ctx->report = REPORT_NONE;
+    initRules(ctx);
+    setStyle(ctx, OUT_ZMAKEBAS);
+}
+
+void p2sFree (P2SPECCY *ctx)
+{
+    /* Free what a context has allocated: the report lines and the rules read
+     * with -R */
+
+    int i;
+
+    for (i = 0; i < H_COUNT; i++)
+        {
+        free(ctx->hits[i].lines);
+        ctx->hits[i].lines = NULL;
+        ctx->hits[i].n = ctx->hits[i].size = 0;
+        }
+    for (i = BUILTIN_RULES; i < ctx->nrules; i++)
+        {
+        free(ctx->rules[i].text);
+        free(ctx->rules[i].note);
+        }
+    initRules(ctx);
+}
+
+void resetFlags (P2SPECCY *ctx)
+{
+    /* Forget what was found in any previous program */
+
+    int c;
+
+    ctx->usr_flag = ctx->slow_flag = ctx->fast_flag = ctx->chr_flag = ctx->poke_flag = 0;
+    ctx->peek_flag = ctx->scroll_flag = ctx->inkey_flag = 0;
+    ctx->udg_flag = ctx->udg_sub = ctx->udg_sub_w = ctx->udg_call = ctx->udg_call_w = 0;
+    ctx->plot_flag = ctx->plot_sub = ctx->plot_sub_w = 0;
+    ctx->mc_sub = ctx->mc_sub_w = 0;
+    ctx->jump_line = ctx->jump_line_w = 0;
+    ctx->prof_sub = ctx->prof_sub_w = 0;
+    ctx->prof_next = 0;
+    ctx->unplot_flag = ctx->unplot_sub = ctx->unplot_sub_w = 0;
+    ctx->plot_call = ctx->unplot_call = ctx->mc_call = 0;
+    ctx->addStop = ctx->prev_k_branch = ctx->prev_line = 0;
+    ctx->compact_lines = 0;
+    ctx->compact_saved = 0;
+    ctx->autorun_line = 0;
+    for (c = 0; c < H_COUNT; c++)
+        ctx->hits[c].n = 0;
+}
+
+int convertProgram (P2SPECCY *ctx, const PFILE *pf, OUTBUF *ob)
+{
+    /* Translate the program in a loaded .P file to ob, in the style set with
+     * setStyle(). With an OUTBUF made with no file, the whole translation is
+     * left in memory for the caller.
+     * Returns 0 if OK, -1 if out of memory.
+     */
+
+    PLINE *lines;
+    long nlines;
+    OUTBUF text;
+
+    /* Both passes use the one table of lines */
+    nlines = pfileIndex(pf, &lines);
+    if ( nlines < 0 )
+        return -1;
+
+    resetFlags(ctx);
+    checkFile(ctx, lines, nlines);           /* 1st pass to check */
+    if ( ctx->renumber && nlines > 0 )
+        {
+        ctx->renum_new = malloc(nlines * sizeof(int));
+        if ( ctx->renum_new == NULL )
+            {
+            free(lines);
+            return -1;
+            }
+        if ( renumberLayout(ctx, lines, nlines, ctx->renum_new) == 0 )
+            {
+            ctx->renum_lines = lines;
+            ctx->renum_n = nlines;
+            }
+        else
+            fprintf(stderr, "Warning: too many lines to renumber\n");
+        }
+    ctx->prof_n = 0;
+    if ( ctx->profile && nlines > 0 )
+        {
+        /* The setup goes on line 1, before anything is counted */
+        if ( ctx->udg_call == 1 && ctx->prof_sub > 0 && ctx->prof_sub + PROF_SUB_LENGTH - 1 <= 9999 )
+            {
+            ctx->prof_n = nlines;
+            ctx->prof_base = SB_UDGADDR - PROF_CODE - PROF_ENTRY * nlines;
+            }
+        else
+            fprintf(stderr, "Warning: no room for the --profile lines, try -N\n");
+        }
+    if ( ctx->optimize )
+        {
+        /* The translation is made in memory for the -O pass */
+        if ( obInit(&text, NULL, 0) != 0 )
+            {
+            free(lines);
+            return -1;
+            }
+        processFile(ctx, lines, nlines, &text);
+        if ( text.error || optimizeText(ctx, &text, ob) != 0 )
+            ob->error = 1;
+        obFree(&text);
+        }
+    else
+        processFile(ctx, lines, nlines, ob); /* 2nd pass to process */
+    free(ctx->renum_new);
+    ctx->renum_new = NULL;
+    ctx->renum_lines = NULL;
+    ctx->renum_n = 0;
+    free(lines);
+    return ob->error ? -1 : 0;
+}
+
+int p2sConvert (P2SPECCY *ctx, const unsigned char *data, long size, OUTBUF *ob)
+{
+    /* Translate the program in a .P file image of size bytes, which is left
+     * as it is, to ob. Returns 0 if OK, -1 if out of memory.
+     */
+
+    PFILE pf;
+    int r;
+
+    pfileBuffer(&pf, (unsigned char *)data, size);
+    r = convertProgram(ctx, &pf, ob);
+    pfileClose(&pf);
+    return r;
+}
+
+void reportStr (P2SPECCY *ctx, OUTBUF *ob, const char *s)
+{
+    /* A quoted string for JSON, or for CSV with quotes doubled */
+
+    obPutc(ob, '"');
+    for ( ; *s; s++)
+        {
+        if ( *s == '"' )
+            obLit(ob, ctx->report == REPORT_CSV ? "\"\"" : "\\\"");
+        else if ( *s == '\\' && ctx->report == REPORT_JSON )
+            obLit(ob, "\\\\");
+        else if ( (unsigned char)*s < ' ' && ctx->report == REPORT_JSON )
+            {
+            obLit(ob, "\\u00");
+            obPutc(ob, "0123456789abcdef"[*s >> 4]);
+            obPutc(ob, "0123456789abcdef"[*s & 15]);
+            }
+        else
+            obPutc(ob, *s);
+        }
+    obPutc(ob, '"');
+}
+
+void reportHeader (OUTBUF *ob)
+{
+    /* The CSV column names */
+
+    int k;
+
+    obLit(ob, "file,lines");
+    for (k = 0; k < H_COUNT; k++)
+        {
+        obPutc(ob, ',');
+        obPuts(ob, hit_name[k]);
+        }
+    obLit(ob, ",udg_call,udg_sub,plot_sub,unplot_sub,stop");
+    for (k = 0; k < H_COUNT; k++)
+        {
+        obPutc(ob, ',');
+        obPuts(ob, hit_name[k]);
+        obLit(ob, "_lines");
+        }
+    obPutc(ob, '\n');
+}
+
+int reportProgram (P2SPECCY *ctx, const PFILE *pf, const char *name, OUTBUF *ob)
+{
+    /* Run just the first pass over a program, and write a record of the
+     * flags it set, the lines that set them, and the lines picked for the
+     * helper routines: a JSON object on one line, or a CSV row with the line
+     * lists separated by spaces.
+     * Returns 0 if OK, -1 if out of memory.
+     */
+
+    PLINE *lines;
+    long nlines, i;
+    int k;
+    int subs[5];
+    static const char *subname[5] = {"udg_call", "udg_sub", "plot_sub", "unplot_sub", "stop"};
+
+    nlines = pfileIndex(pf, &lines);
+    if ( nlines < 0 )
+        return -1;
+    resetFlags(ctx);
+    checkFile(ctx, lines, nlines);
+    free(lines);
+    subs[0] = ctx->udg_call;
+    subs[1] = ctx->udg_sub;
+    subs[2] = ctx->plot_sub;
+    subs[3] = ctx->unplot_sub;
+    subs[4] = ctx->addStop;
+
+    if ( ctx->report == REPORT_CSV )
+        {
+        reportStr(ctx, ob, name);
+        obPutc(ob, ',');
+        obNum(ob, nlines, 0);
+        for (k = 0; k < H_COUNT; k++)
+            {
+            obPutc(ob, ',');
+            obNum(ob, HIT_FLAG(ctx, k), 0);
+            }
+        for (k = 0; k < 5; k++)
+            {
+            obPutc(ob, ',');
+            obNum(ob, subs[k], 0);
+            }
+        for (k = 0; k < H_COUNT; k++)
+            {
+            obPutc(ob, ',');
+            for (i = 0; i < ctx->hits[k].n; i++)
+                {
+                if ( i )
+                    obPutc(ob, ' ');
+                obNum(ob, ctx->hits[k].lines[i], 0);
+                }
+            }
+        }
+    else
+        {
+        obLit(ob, "{\"file\":");
+        reportStr(ctx, ob, name);
+        obLit(ob, ",\"lines\":");
+        obNum(ob, nlines, 0);
+        obLit(ob, ",\"flags\":{");
+        for (k = 0; k < H_COUNT; k++)
+            {
+            if ( k )
+                obPutc(ob, ',');
+            obPutc(ob, '"');
+            obPuts(ob, hit_name[k]);
+            obLit(ob, "\":");
+            obNum(ob, HIT_FLAG(ctx, k), 0);
+            }
+        obLit(ob, "},\"hits\":{");
+        for (k = 0; k < H_COUNT; k++)
+            {
+            if ( k )
+                obPutc(ob, ',');
+            obPutc(ob, '"');
+            obPuts(ob, hit_name[k]);
+            obLit(ob, "\":[");
+            for (i = 0; i < ctx->hits[k].n; i++)
+                {
+                if ( i )
+                    obPutc(ob, ',');
+                obNum(ob, ctx->hits[k].lines[i], 0);
+                }
+            obPutc(ob, ']');
+            }
+        obLit(ob, "},\"subs\":{");
+        for (k = 0; k < 5; k++)
+            {
+            if ( k )
+                obPutc(ob, ',');
+            obPutc(ob, '"');
+            obPuts(ob, subname[k]);
+            obLit(ob, "\":");
+            obNum(ob, subs[k], 0);
+            }
+        obLit(ob, "}}");
+        }
+    obPutc(ob, '\n');
+    return ob->error ? -1 : 0;
+}
+
+int writeTap (P2SPECCY *ctx, FILE *out, const OUTBUF *text, const char *name)
+{
+    /* Tokenize the zmakebas text of a converted program and write it as a
+     * .tap file called name, set to run from the SAVE LINE if there is one,
+     * followed by the grey UDGs as CODE for -u code.
+     * Returns 0 if OK, -1 if there was a problem.
+     */
+
+    OUTBUF prog;
+    unsigned char udg[48];
+    int f, r;
+
+    if ( obInit(&prog, NULL, OB_SIZE) != 0 )
+        return -1;
+    r = sbTokenize(text->buf, text->len, &prog);
+    if ( r == 0 && prog.len > 65535 - 23755 )
+        {
+        fprintf(stderr, "Error: the program is too big for the Spectrum\n");
+        r = -1;
+        }
+    if ( r == 0 )
+        r = sbTapFile(out, SB_PROGRAM, name, (unsigned char *)prog.buf, prog.len,
+                      ctx->autorun_line ? ctx->autorun_line : SB_NOAUTO, prog.len);
+    if ( r == 0 && ctx->udg_flag && ctx->udg_mode == UDG_CODE )
+        {
+        /* The grey UDGs, for the LOAD ""CODE at the start */
+        for (f = 0; f < 48; f++)
+            udg[f] = udgByte(f);
+        r = sbTapFile(out, SB_CODE, "grey UDGs", udg, 48, SB_UDGADDR, 32768U);
+        }
+    obFree(&prog);
+    return r;
+}
+
+int writeSnapshot (P2SPECCY *ctx, FILE *out, const OUTBUF *text, int sna)
+{
+    /* Tokenize the zmakebas text of a converted program and write it as a
+     * 48K snapshot, .sna if sna is set or else .z80, that runs it from the
+     * first line, with the grey UDGs and the -p mc code already set.
+     * Returns 0 if OK, -1 if there was a problem.
+     */
+
+    OUTBUF prog;
+    unsigned char *ram, udg[48 + MC_LENGTH];
+    int f, r;
+    size_t n;
+    unsigned line = 0;
+
+    for (f = 0; f < 48; f++)
+        udg[f] = udgByte(f);
+    memcpy(udg + 48, mc_code, MC_LENGTH); /* Right after the grey UDGs */
+    n = ctx->mc_call ? sizeof(udg) : 48;
+    ram = malloc(SB_RAMSIZE);
+    if ( ram == NULL || obInit(&prog, NULL, OB_SIZE) != 0 )
+        {
+        free(ram);
+        return -1;
+        }
+    r = sbTokenize(text->buf, text->len, &prog);
+    if ( r == 0 && prog.len >= 2 )
+        line = (unsigned char)prog.buf[0] << 8 | (unsigned char)prog.buf[1];
+    if ( r == 0 && sbMemory(ram, (unsigned char *)prog.buf, prog.len, line, udg, n) != 0 )
+        {
+        fprintf(stderr, "Error: the program is too big for the Spectrum\n");
+        r = -1;
         }
-    writeSubs(out, 20000);
+    if ( r == 0 )
+        r = sna ? sbSnaFile(out, ram) : sbZ80File(out, ram);
+    obFree(&prog);
+    free(ram);
+    return r;
 }
 
+#ifndef P2SPECCY_LIB
+
+/* The command line, for main() */
+char *infile = NULL;
+char *outfile = "";
+char *tapename = "";    /* Spectrum file name in a .tap */
+enum outformat {FMT_TEXT, FMT_TAP, FMT_SNA, FMT_Z80};
+enum outformat format = FMT_TEXT;
+int formatSet = 0;      /* Format given with -f rather than from the -o name */
+char **infiles = NULL;  /* With --report, the files to scan */
+int ninfiles = 0;
+
 void printUsage ()
 {
+    int i;
+
     printf("p2speccy %s by Ryan Gray\n", VERSION);
     printf("Translates a ZX81 .P file program to Spectrum BASIC text.\n");
     printf("Usage:  p2speccy [options] infile.p > outfile\n");
     printf("Usage:  p2speccy [options] -o  outfile infile.p\n");
+    printf("Usage:  p2speccy --report json|csv [-o outfile] infile.p ...\n");
+    printf("Use - or . as infile to read the .P file from stdin.\n");
     printf("Options are:\n");
     printf("  -z            Output Zmakebas compatible markup\n");
     printf("  -r            Output a more readable markup (default).\n");
     printf("                Inverse characters in square brackets, most block graphics.\n");
     printf("  -o outfile    Give the name of an output file rather than using stdout.\n");
+    printf("                A name ending in .tap, .sna or .z80 gives that format.\n");
+    printf("  -f format     Output format: txt (the default); tap, a Spectrum tape\n");
+    printf("                file of the program tokenized as by zmakebas (-z markup);\n");
+    printf("                or sna or z80, a 48K snapshot that runs the program.\n");
+    printf("  -n name       Spectrum file name in a .tap (default is blank).\n");
+    printf("  -O            Optimize: remove REM lines, join lines, shorten jumps and\n");
+    printf("                use faster Spectrum code, and estimate the time saved.\n");
+    printf("  -R rulefile   Add the rewrite rules in a file to the built in ones.\n");
+    printf("  -N            Renumber, with the helper routines at the lowest lines.\n");
+    printf("  -c            Write numbers as NOT PI, SGN PI, CODE \"c\" or VAL \"n\" where\n");
+    printf("                that takes less memory, and list the bytes saved.\n");
+    printf("  -u method     How the grey block UDGs are set up at the start: basic\n");
+    printf("                POKEs from DATA (the default), code to LOAD them from a\n");
+    printf("                CODE block after the program in a .tap, or rem to copy\n");
+    printf("                them with machine code in a REM.\n");
+    printf("  -p method     How PLOT and UNPLOT draw the 4x size pixels. Estimated\n");
+    printf("                T-states for each PLOT on a 48K Spectrum:\n");
+    for (i = 0; i < 3; i++)
+        printf("                  %-6s %6ld%s\n", plotModes[i].name, plotModes[i].tstates,
+               i == 0 ? "  7 DRAWs (the default)" :
+               i == 1 ? "  PRINT a quarter block" : "  machine code in UDGs \"g\" up");
+    printf("  --profile     Count the times each line runs, in a table above RAMTOP,\n");
+    printf("                and add a routine that lists the counts.\n");
+    printf("  --report json|csv  Don't translate, but write a record for each of any\n");
+    printf("                number of infiles of what needs changing and on which lines.\n");
     printf("  -? or --help  Print this usage.\n");
+    printf("  --version     Print the version.\n");
     printf("The Zmakebas output will use \\{xxx} codes in REMs and quotes to preserve\n");
     printf("the non-printable and token character codes, whereas in readable mode, these\n");
     printf("will give a hash (#) character. Zmakebas mode also inserts inverse and true\n");
     printf("video codes where inverse characters appear in REMs and strings.\n");
 }
 
-void parseOptions (int argc, char *argv[])
+void parseOptions (P2SPECCY *ctx, int argc, char *argv[])
 {
+    char *ext;
+    int i;
+
     while ((argc > 1) && (argv[1][0] == '-'))
         {
         switch (argv[1][1])
             {
             case 'z':
-                style = OUT_ZMAKEBAS;
-                charset = charset_zmb;
+                ctx->style = OUT_ZMAKEBAS;
+                ctx->charset = charset_zmb;
                 break;
             case 'r':
-                style = OUT_READABLE;
-                charset = charset_read;
+                ctx->style = OUT_READABLE;
+                ctx->charset = charset_read;
                 break;
             case 'o':
                 outfile = argv[2];
                 ++argv;
                 --argc;
                 break;
+            case 'p':
+                for (i = 0; argc > 2 && i < 3 && STRCMPI(argv[2], plotModes[i].name) != 0; i++)
+                    ;
+                if ( argc < 3 || i == 3 )
+                    {
+                    printUsage();
+                    fprintf(stderr, "unknown PLOT method: %s\n", argc < 3 ? "" : argv[2]);
+                    exit(EXIT_FAILURE);
+                    }
+                setPlotMode(ctx, (enum plotmode)i);
+                ++argv;
+                --argc;
+                break;
+            case 'u':
+                for (i = 0; argc > 2 && i < 3 && STRCMPI(argv[2], udgModes[i]) != 0; i++)
+                    ;
+                if ( argc < 3 || i == 3 )
+                    {
+                    printUsage();
+                    fprintf(stderr, "unknown UDG method: %s\n", argc < 3 ? "" : argv[2]);
+                    exit(EXIT_FAILURE);
+                    }
+                ctx->udg_mode = (enum udgmode)i;
+                ++argv;
+                --argc;
+                break;
+            case 'N':
+                ctx->renumber = 1;
+                break;
+            case 'c':
+                ctx->compact = 1;
+                break;
+            case 'O':
+                ctx->optimize = 1;
+                break;
+            case 'R':
+                if ( argc < 3 || loadRules(ctx, argv[2]) != 0 )
+                    exit(EXIT_FAILURE);
+                ++argv;
+                --argc;
+                break;
+            case 'n':
+                tapename = argv[2];
+                ++argv;
+                --argc;
+                break;
+            case 'f':
+                if ( argc < 3 )
+                    {
+                    printUsage();
+                    exit(EXIT_FAILURE);
+                    }
+                if ( STRCMPI(argv[2], "tap") == 0 )
+                    format = FMT_TAP;
+                else if ( STRCMPI(argv[2], "sna") == 0 )
+                    format = FMT_SNA;
+                else if ( STRCMPI(argv[2], "z80") == 0 )
+                    format = FMT_Z80;
+                else if ( STRCMPI(argv[2], "txt") == 0 )
+                    format = FMT_TEXT;
+                else
+                    {
+                    printUsage();
+                    fprintf(stderr, "unknown output format: %s\n", argv[2]);
+                    exit(EXIT_FAILURE);
+                    }
+                formatSet = 1;
+                ++argv;
+                --argc;
+                break;
             case '?':
                 printUsage();
                 exit(EXIT_SUCCESS);
+            case '\0':
+                infile = argv[1]; /* - alone is stdin */
+                break;
             case '-':
-                if (strcmp(argv[1],"-") == 0)
-                    {
-                    infile = argv[1];
-                    }
-                else if (STRCMPI(argv[1],"--help") == 0)
+                if (STRCMPI(argv[1],"--help") == 0)
                     {
                     printUsage();
                     exit(EXIT_SUCCESS);
@@ -683,12 +2479,32 @@ void parseOptions (int argc, char *argv[])
                 else if (STRCMPI(argv[1],"--version") == 0)
                     {
                     printf("%s\n", VERSION);
+                    exit(EXIT_SUCCESS);
                     }
-                else
+                else if (STRCMPI(argv[1],"--profile") == 0)
                     {
-                    printUsage();
-                    exit(EXIT_FAILURE);
+                    ctx->profile = 1;
+                    break;
+                    }
+                else if (STRCMPI(argv[1],"--report") == 0 && argc > 2)
+                    {
+                    if ( STRCMPI(argv[2], "json") == 0 )
+                        ctx->report = REPORT_JSON;
+                    else if ( STRCMPI(argv[2], "csv") == 0 )
+                        ctx->report = REPORT_CSV;
+                    else
+                        {
+                        printUsage();
+                        fprintf(stderr, "unknown report style: %s\n", argv[2]);
+                        exit(EXIT_FAILURE);
+                        }
+                    ++argv;
+                    --argc;
+                    break;
                     }
+                printUsage();
+                fprintf(stderr, "unknown option: %s\n", argv[1]);
+                exit(EXIT_FAILURE);
             default:
                 printUsage();
                 fprintf(stderr, "unknown option: %c\n", argv[1][1]);
@@ -697,31 +2513,124 @@ void parseOptions (int argc, char *argv[])
 	    ++argv;
 	    --argc;
         }
-    if (argc <= 1)
+    if (argc <= 1 && !infile)
         {
         printUsage();
         exit(EXIT_FAILURE);
         }
+    if ( ctx->report != REPORT_NONE )
+        {
+        /* Every file left is scanned */
+        infiles = infile ? &infile : argv + 1;
+        ninfiles = infile ? 1 : argc - 1;
+        return;
+        }
     if (!infile)
         infile = argv[argc-1];
+
+    /* The output format can come from the output file name */
+    ext = strrchr(outfile, '.');
+    if ( !formatSet && ext )
+        {
+        if ( STRCMPI(ext, ".tap") == 0 )
+            format = FMT_TAP;
+        else if ( STRCMPI(ext, ".sna") == 0 )
+            format = FMT_SNA;
+        else if ( STRCMPI(ext, ".z80") == 0 )
+            format = FMT_Z80;
+        }
 }
 
 
+int reportFiles (P2SPECCY *ctx)
+{
+    /* Write a report record for each input file, without translating them.
+     * Returns the exit status: 0 if all were read, 1 if any weren't.
+     */
+
+    FILE *in, *out = stdout;
+    PFILE pf;
+    OUTBUF ob;
+    int i, status = 0;
+
+    if ( outfile[0] != '\0' )
+        {
+        out = fopen(outfile, "wt");
+        if ( out == NULL )
+            {
+            fprintf(stderr, "Error: couldn't write output file '%s'\n", outfile);
+            return 1;
+            }
+        }
+    if ( obInit(&ob, out, OB_SIZE) != 0 )
+        {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+        }
+    if ( ctx->report == REPORT_CSV )
+        reportHeader(&ob);
+    for (i = 0; i < ninfiles; i++)
+        {
+        if ( strcmp(infiles[i], ".") == 0 || strcmp(infiles[i], "-") == 0 )
+            {
+            in = stdin;
+#ifdef __MSDOS__
+            setmode(fileno(stdin), O_BINARY);
+#endif
+            }
+        else
+            in = fopen(infiles[i], "rb");
+        if ( in == NULL || pfileRead(&pf, in) != 0 )
+            {
+            fprintf(stderr, "Error: couldn't read file '%s'\n", infiles[i]);
+            if ( in != NULL && in != stdin )
+                fclose(in);
+            status = 1;
+            continue;
+            }
+        if ( in != stdin )
+            fclose(in);
+        if ( reportProgram(ctx, &pf, infiles[i], &ob) != 0 )
+            {
+            fprintf(stderr, "Error: out of memory\n");
+            status = 1;
+            }
+        pfileClose(&pf);
+        }
+    obFlush(&ob);
+    if ( ob.error || fclose(out) != 0 )
+        {
+        fprintf(stderr, "Error: couldn't write the output\n");
+        status = 1;
+        }
+    obFree(&ob);
+    return status;
+}
+
 int main (int argc, char *argv[])
 {
     FILE *in, *out;
-    int linenum;
+    PFILE pf;
+    OUTBUF ob;
+    P2SPECCY conv, *ctx = &conv;
 
     if (argc < 2)
         {
         printUsage();
         exit(EXIT_FAILURE);
         }
-    parseOptions(argc, argv);
-
-    if ( strcmp(infile,".") == 0 )
+    p2sInit(ctx);
+    parseOptions(ctx, argc, argv);
+    if ( ctx->report != REPORT_NONE )
+        exit(reportFiles(ctx));
 
+    if ( strcmp(infile,".") == 0 || strcmp(infile,"-") == 0 )
+        {
         in = stdin;
+#ifdef __MSDOS__
+        setmode(fileno(stdin), O_BINARY);
+#endif
+        }
 
     else
         {
@@ -734,10 +2643,16 @@ int main (int argc, char *argv[])
         }
 
     if ( outfile[0] == '\0' )
+        {
         out = stdout;
+#ifdef __MSDOS__
+        if ( format != FMT_TEXT )
+            setmode(fileno(stdout), O_BINARY);
+#endif
+        }
     else
         {
-        out = fopen(outfile, "wt");
+        out = fopen(outfile, format == FMT_TEXT ? "wt" : "wb");
         if ( out == NULL )
             {
             fprintf(stderr, "Error: couldn't write output file '%s'\n", outfile);
@@ -745,15 +2660,55 @@ int main (int argc, char *argv[])
             }
         }
 
-    if ( style == OUT_READABLE)
-        warn = warn_READ;
-    else
-        warn = warn_ZMB;
+    if ( format != FMT_TEXT )
+        ctx->style = OUT_ZMAKEBAS; /* This is what gets tokenized */
+    ctx->udg_preset = format == FMT_SNA || format == FMT_Z80;
+    if ( ctx->udg_mode == UDG_CODE && format == FMT_TEXT )
+        fprintf(stderr, "Note: -u code needs a CODE block of the UDGs after the program, as -f tap makes\n");
+    setStyle(ctx, ctx->style);
 
-    checkFile(in, &linenum); /* 1st pass to check */
-    processFile(in, out);    /* 2nd pass to process */
-    fclose(in);
-    fclose(out);
+    if ( pfileRead(&pf, in) != 0 )
+        {
+        fprintf(stderr, "Error: couldn't read file '%s'\n", infile);
+        exit(1);
+        }
+    if ( in != stdin )
+        fclose(in);
+
+    /* Build the whole translation in memory and write it in one go */
+    if ( obInit(&ob, NULL, OB_SIZE) != 0 || convertProgram(ctx, &pf, &ob) != 0 )
+        {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+        }
+    pfileClose(&pf);
+    if ( format == FMT_TAP )
+        {
+        if ( writeTap(ctx, out, &ob, tapename) != 0 )
+            {
+            fprintf(stderr, "Error: couldn't make the .tap file\n");
+            exit(1);
+            }
+        }
+    else if ( format != FMT_TEXT )
+        {
+        if ( writeSnapshot(ctx, out, &ob, format == FMT_SNA) != 0 )
+            {
+            fprintf(stderr, "Error: couldn't make the snapshot\n");
+            exit(1);
+            }
+        }
+    else if ( fwrite(ob.buf, 1, ob.len, out) != ob.len )
+        ob.error = 1;
+    if ( ob.error || fclose(out) != 0 )
+        {
+        fprintf(stderr, "Error: couldn't write the output\n");
+        exit(1);
+        }
+    obFree(&ob);
+    p2sFree(ctx);
 
     exit(0);
 }
+
+#endif
@@ -0,0 +1,130 @@
+/* p2speccy - convert the BASIC program in a ZX81 .p file to ZX Spectrum BASIC
+ * By Ryan Gray
+ *
+ * Everything a conversion changes is kept in a P2SPECCY context rather than
+ * in globals, so a program that builds p2speccy.c with -DP2SPECCY_LIB (which
+ * leaves out main()) can convert several programs at once, one context to a
+ * thread:
+ *
+ *   P2SPECCY ctx;
+ *   OUTBUF ob;
+ *
+ *   p2sInit(&ctx);                          the defaults, as with no options
+ *   setStyle(&ctx, OUT_READABLE);           then any options
+ *   obInit(&ob, NULL, 0);
+ *   p2sConvert(&ctx, image, size, &ob);     the .p file image to ob
+ *   p2sFree(&ctx);
+ *
+ * The tables p2speccy reads but never changes, like the character sets, are
+ * shared.
+ */
+
+#ifndef P2SPECCY_H
+#define P2SPECCY_H
+
+#include "pfile.h"
+#include "outbuf.h"
+
+enum outstyle {OUT_READABLE, OUT_ZMAKEBAS};
+enum udgmode {UDG_BASIC, UDG_CODE, UDG_REM};
+enum plotmode {PLOT_DRAW, PLOT_PRINT, PLOT_MC};
+enum reportstyle {REPORT_NONE, REPORT_JSON, REPORT_CSV};
+
+/* What the first pass finds, for --report: the lines each flag was set on */
+enum hitkind {H_USR, H_PEEK, H_POKE, H_CHR, H_INKEY, H_SCROLL, H_UDG, H_PLOT, H_UNPLOT,
+              H_SLOW, H_FAST, H_COUNT};
+typedef struct
+    {
+    int *lines;
+    long n, size;
+    } HITS;
+
+/* A rewrite rule for a ZX81 command or function (see p2speccy.c) */
+#define MAX_RULES   512
+typedef struct
+    {
+    int kind;               /* RULE_COMMAND or RULE_FUNCTION */
+    int token;              /* ZX81 code */
+    char *text;             /* Replaces the token, or NULL to keep it */
+    char *note;             /* Added at the end of the line, or NULL */
+    int flags;
+    int textlen, notelen;
+    } RULE;
+
+typedef struct
+    {
+    /* Options */
+    enum outstyle style;
+    enum udgmode udg_mode;  /* How the grey UDGs are set up at the start */
+    enum plotmode plot_mode;
+    enum reportstyle report;
+    int udg_preset;         /* The UDGs are already in memory, so don't call the routine */
+    int renumber;           /* -N */
+    int compact;            /* -c */
+    int optimize;           /* -O */
+    int profile;            /* --profile */
+
+    /* The output style's tables, set by setStyle() */
+    char **charset;
+    int charlen[256];       /* Lengths of the charset strings */
+    int tc_grey;            /* Classes shown as grey UDGs in the output style */
+    int tc_inverse;         /* Classes shown as inverse in the output style */
+    char *warn;
+
+    /* The built in rules, then any from -R, and their dispatch tables by
+     * ZX81 code */
+    RULE rules[MAX_RULES];
+    int nrules;
+    RULE *cmdRule[256];
+    RULE *fnRule[256];
+
+    /* Flags that a function was used somewhere (set in the 1st pass) */
+    int usr_flag, slow_flag, fast_flag, chr_flag, poke_flag, peek_flag;
+    int scroll_flag, inkey_flag;
+    int udg_flag;           /* Were grey block chars used? We need to define them as UDGs */
+    int plot_flag;          /* Was a PLOT command used? */
+    int unplot_flag;        /* The same for UNPLOT */
+    int plot_call, unplot_call, mc_call; /* Do the rules used call the big pixel routines? (%p %u %m) */
+    HITS hits[H_COUNT];
+
+    /* Lines of the helper routines, and whether they have been written */
+    int udg_call, udg_call_w;   /* The call to the UDG routine */
+    int udg_sub, udg_sub_w;     /* The UDG routine */
+    int mc_sub, mc_sub_w;       /* The routine that POKEs the mc PLOT code */
+    int plot_sub, plot_sub_w;   /* The big-pixel PLOT routine */
+    int unplot_sub, unplot_sub_w;
+    int prof_sub, prof_sub_w;   /* The routine that lists the --profile counts */
+    int jump_line, jump_line_w; /* A GO TO past the helper routines, for -N */
+    int addStop;            /* If > 0, line number of STOP to add at end of program before subroutines */
+    int prev_k_branch;      /* Was the command code of the previous line a branch or stop? */
+    int prev_line;          /* The previous line number */
+    int autorun_line;       /* Line a SAVE LINE will run from, for the .tap header */
+
+    /* -N */
+    long renum_n;           /* Lines in the renumbering, 0 when not renumbering */
+    const PLINE *renum_lines;
+    int *renum_new;         /* New number of each line */
+
+    /* -c */
+    int compact_line;       /* Bytes saved on the line being translated */
+    int compact_lines;      /* Lines that got smaller */
+    long compact_saved;     /* Bytes saved in the whole program */
+
+    /* --profile */
+    long prof_n;            /* Lines with a counter, 0 when not profiling */
+    long prof_next;         /* The counter of the next line */
+    long prof_base;         /* Address of the counting routine, then the entries */
+    } P2SPECCY;
+
+void p2sInit (P2SPECCY *ctx);
+void p2sFree (P2SPECCY *ctx);
+int  p2sConvert (P2SPECCY *ctx, const unsigned char *data, long size, OUTBUF *ob);
+
+void setStyle (P2SPECCY *ctx, enum outstyle s);
+void setPlotMode (P2SPECCY *ctx, enum plotmode m);
+int  loadRules (P2SPECCY *ctx, const char *name);
+int  convertProgram (P2SPECCY *ctx, const PFILE *pf, OUTBUF *ob);
+int  reportProgram (P2SPECCY *ctx, const PFILE *pf, const char *name, OUTBUF *ob);
+void reportHeader (OUTBUF *ob);
+
+#endif
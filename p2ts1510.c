@@ -1,6 +1,7 @@
 /* 
  * Convert a ZX81/TS1000/TS1500 program in a P file to a TS1510 cartridge ROM
- * image (up to 8K program) or two 8K images for a 16K program.
+ * image (up to 8K program), or to two or three 8K images for a 16K or 24K
+ * cartridge.
  *
  * The general scheme is to store the BASIC program at offset $0100 in the image
  * and put a loader machine code at $0000 that initializes the BASIC system, 
@@ -10,10 +11,10 @@
  * The 8K ROM is mapped to $2000-$3FFF, which is the "shadow ROM" location, so
  * the BASIC program is stored at $2100 and needs to get copied to 16509.
  * If the program is longer than 8K ($2000-$100=7936, or bytes past 24444), it 
- * is split into two 8K images with the second 8K getting mapped to $8000, but 
- * that doesn't need a 256 byte loader if we put that loader in with the first
- * loader. We certainly need to detect that it is a two ROM cart in order to
- * copy the second block.
+ * is split into more 8K images, with the second 8K getting mapped to $8000 and
+ * the third to $A000, but they don't need a 256 byte loader if we put that
+ * loader in with the first loader. The loader copies each block as a list of
+ * segments, one in each ROM the block reaches.
  * 
  * Some Technical Info provided by Paul Farrow:
  * The TS1510 ROM cartridges can be either 8K, 16K or 24K.
@@ -28,10 +29,10 @@
  * 
  * I have modified the loader slightly from what is used in the old carts. I've
  * moved the addresses and other data from the end of the first 8K to just
- * before $2100 since there was plenty of room. I also have it built to handle
- * including variables as well as splitting either the program or the variables
- * across two ROMs. I'm only handling two ROMS right now since I don't know how
- * 24K carts work other than where EightyOne says it maps the 3rd 8K.
+ * after the loader since there was plenty of room. I also have it built to
+ * handle including variables as well as splitting either the program or the
+ * variables across the ROMs. A 16K P file only needs the third ROM when the
+ * loader and the P file come to more than 16K between them.
  * 
  */
 
@@ -39,7 +40,9 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define VERSION "1.0.6"
+#include "pfile.h"
+
+#define VERSION "1.2.0"
 
 #define ROM8K 8192      /* 8K buffer size for making the ROM images */
 #define BUFFSZ 16384    /* Buffer size for P file */
@@ -66,37 +69,40 @@ int shortRomFile = 0;
 int oneRom = 1;
 int infoOnly = 0;    /* Only printing P file and block info but no ROMs */
 int tapeLikeLoader = 1; /* Load every byte of the P file like loading from tape */
+int compress = 0;    /* Pack the blocks with LZ and unpack them in the loader */
 ADDR thisRomSize = 0;
 ADDR prevRomSize = 0; /* Length of ROM written so far */
 
 /* Memory map:
  *
  * $2000-$3FFF ROM A in memory
- * $2000-$20FF Loader program
- * $2100-$3FEB Program data to load
- * $3FEB-$3FFF Addresses & lengths of program & variables blocks, autostart line
+ * $2000-$20FF Loader program, then the table below
+ * $20xx-$3FFF Program data to load, after the table
+ * $8000-$9FFF ROM B, more program data if needed
+ * $A000-$BFFF ROM C, and more after that
  */
 
 /* Memory address origins of ROMs */
 #define ORGA 0x2000 /* ROM A */
 #define ORGB 0x8000 /* ROM B */
+#define ORGC 0xA000 /* ROM C */
+#define ROMS 3      /* Most ROMs in a cartridge */
+
+ADDR romOrg[ROMS] = {ORGA, ORGB, ORGC};
 
 /* Reserved location offsets after the end of the ROM loader code */
 /* Add ORGA to these offsets to get a memory address */
 /* Add loaderSize to get a rom[] offset */
 /* NOTE: The original loaders had these at the end of the 1st 8K ROM and in a different order */
+/* Each block has a source address and length for each ROM, a length of zero
+ * for the ROMs it doesn't reach. */
 
-#define PROG1S 0x00 /* Source address of program block 1 */
-#define PROG1L 0x02 /* Length of program block 1 */
-#define PROG2S 0x04 /* Second program block source address (likely $8000) */
-#define PROG2L 0x06 /* Second program block length (zero if no 2nd program block) */
-#define VARS1S 0x08 /* Source address of vars block 1 */
-#define VARS1L 0x0A /* Length of VARS block 1 */
-#define VARS2S 0x0C /* Source address of vars block 2 */
-#define VARS2L 0x0E /* Length of VARS block 2 */
-#define AUTOAD 0x10 /* Auto start line address (need to figure) */
-#define AUTOLN 0x12 /* Program line to start */
-#define PCDFLAG 0x14 /* Store value of CDFLAG from P file */
+#define PROGSEG 0x00 /* Program block segments, ROMS source and length pairs */
+#define VARSSEG 0x0C /* Vars block segments */
+#define VARSLEN 0x18 /* Total length of the vars block */
+#define AUTOAD  0x1A /* Auto start line address (need to figure) */
+#define AUTOLN  0x1C /* Program line to start */
+#define PCDFLAG 0x1E /* Store value of CDFLAG from P file */
 
 /* Some of the system variable addresses */
 #define RAMTOP  16388 /* 0x4004 */
@@ -118,6 +124,7 @@ ADDR prevRomSize = 0; /* Length of ROM written so far */
 
 BYTE rom[ROM8K];    /* Holds each 8K ROM image being built */
 BYTE buff[BUFFSZ];  /* Holds the contents of the P file */
+PFILE pf;           /* Line access to buff */
 /* Pointers to the sections of the P file */
 BYTE *prg;
 BYTE *var;
@@ -156,22 +163,12 @@ BYTE ldr1[] = {
     0xed, 0x47,             /* ld i,a */
     0xed, 0x56,             /* im 1 */
     0xfd, 0x21, 0x00, 0x40, /* ld iy,0x4000     Set index to start of RAM */
-    0x3a, 0xce, 0x20,		/* ld a,(PCDFLAG)   Get CDFLAG value stored at end of ROM  */
+    0x3a, 0xc8, 0x20,       /* ld a,(PCDFLAG)   Get CDFLAG value stored after the loader */
     0xfd, 0x77, 0x3b,       /* ld (iy+03bh),a   Set CDFLAG */
-    0xed, 0x4b, 0xbc, 0x20, /* ld bc,(PROG1L)   Get length of block to copy */
-    0x78,                   /* ld a,b */
-    0xb1,                   /* or c */
-    0x28, 0x15,             /* jr z, +0x15      Skip prog block copy for bc==0 (probably vars only) */
-    0x2a, 0xba, 0x20,       /* ld hl,(PROG1S)   Get block source from end of rom */
+    0x21, 0xaa, 0x20,       /* ld hl,PROGSEG    Program block segments */
     0x11, 0x7d, 0x40,       /* ld de,0x407d     Set block destination to start of program (16509) */
-    0xed, 0xb0,             /* ldir             Copy first program block */
-    /* Check for second prog block to copy and copy it */
-    0xed, 0x4b, 0xc0, 0x20, /* ld bc,(PROG2L)   Load bc with length of 2nd program block */
-    0x78,                   /* ld a,b */
-    0xb1,                   /* or c */
-    0x28, 0x05,             /* jr z, +5         Skip copy for bc==0 */
-    0x2a, 0xbe, 0x20,       /* ld hl,(PROG2S)   Get source address of 2nd program block */
-    0xed, 0xb0,             /* ldir             Copy program block 2 */
+    0x06, 0x03,             /* ld b,ROMS */
+    0xcd, 0x94, 0x20,       /* call SEGS        Copy the program block */
     0xeb,                   /* ex de,hl         hl = de, which is dest byte after program (D_FILE should start there) */
     0x22, 0x0c, 0x40,       /* ld (D_FILE),hl   Set D_FILE location to be after the program */
     0x06, 0x19,             /* ld b,0x19        Set it up as 25 newlines */
@@ -184,32 +181,22 @@ BYTE ldr1[] = {
     0xcd, 0xad, 0x14,       /* call 0x14ad  CURSOR-IN: sets up lower screen to 2 lines and clear calc stack (uses hl) */
     0xcd, 0x07, 0x02,       /* call 0x0207  SLOW/FAST: test CDFLAG bit 6 to set mode (uses hl, a, b) */
     0xcd, 0x2a, 0x0a,       /* call 0x0a2a  CLS: will expand a collapsed display file if enough RAM (uses bc, a, hl, de) */
-    0xed, 0x4b, 0xc4, 0x20, /* ld bc,(VARS1L)   Get variables block 1 length */
+    0xed, 0x4b, 0xc2, 0x20, /* ld bc,(VARSLEN)  Get the total vars length */
     /* If bc==0, no vars block, so skip vars loading */
     0x78,                   /* ld a,b */
     0xb1,                   /* or c */
-    0x28, 0x25,             /* jr z, +0x21      Skip vars copy for bc==0 */
-    0x2a, 0xc8, 0x20,       /* ld hl,(VARS2L)   Get variables block 2 length */
-    0x09,                   /* add hl, bc  hl=hl+bc = Total vars size */
-    0x44,                   /* ld b,h bc = hl = total vars length */
-    0x4d,                   /* ld c,l */
+    0x28, 0x11,             /* jr z, +0x11      Skip vars copy for bc==0 */
     0x2a, 0x14, 0x40,       /* ld hl,(E_LINE)   Get new E_LINE */
     0x2b,                   /* dec hl           why? Point to the $80 at end of empty vars? */
-    0xcd, 0x9e, 0x09,       /* call 0x099e      Making room for the vars block? We will have to add VARS1L and VARS2L */
+    0xcd, 0x9e, 0x09,       /* call 0x099e      Making room for the vars block */
     0x23,                   /* inc hl           hl must point to VARS-1 after? */
     0xeb,                   /* ex de,hl		    de=hl to set the destination (VARS) for the vars block */
-    0x2a, 0xc2, 0x20,       /* ld hl,(VARS1S)   Get variables block 1 source address */
-    0xed, 0x4b, 0xc4, 0x20, /* ld bc,(VARS1L)   Get variables block 1 length */
-    0xed, 0xb0,             /* ldir             Copy the vars block 1 */
-    0xed, 0x4b, 0xc8, 0x20, /* ld bc,(VARS2L)   Get varaibles block 2 length */
-    0x78,                   /* ld a,b */
-    0xb1,                   /* or c */
-    0x28, 0x05,             /* jr z, +5         Skip vars 2 copy for bc==0 */
-    0x2a, 0xc6, 0x20,       /* ld hl,(VARS2S)   Get variables block 2 source address */
-    0xed, 0xb0,             /* ldir             Copy the vars block 2 */
+    0x21, 0xb6, 0x20,       /* ld hl,VARSSEG    Variables block segments */
+    0x06, 0x03,             /* ld b,ROMS */
+    0xcd, 0x94, 0x20,       /* call SEGS        Copy the vars block */
     /* All done copying, set auto start */
-    0xed, 0x4b, 0xcc, 0x20, /* ld bc,(AUTOLN)   Get program line to start */
-    0xed, 0x5b, 0xca, 0x20, /* ld de,(AUTOAD)   Get program address to start **** This needs to be NXTLIN because */
+    0xed, 0x4b, 0xc6, 0x20, /* ld bc,(AUTOLN)   Get program line to start */
+    0xed, 0x5b, 0xc4, 0x20, /* ld de,(AUTOAD)   Get program address to start **** This needs to be NXTLIN because */
     0x62,                   /* ld h,d hl=de     For call to NEXT-LINE later     **** we dec de to set CH_ADD with it */
     0x6b,                   /* ld l,e */
     0x1b,                   /* dec de           CH_ADD points one less than you would think */
@@ -221,10 +208,31 @@ BYTE ldr1[] = {
     /* Start BASIC interpreter */
     0x3e, 0xff,             /* ld a,0xff */
     0x32, 0x7c, 0x40,       /* ld (16508),a     Why are we setting the unused byte before the program to $FF? */
-    0xc3, 0x6c, 0x06        /* jp 0x066c        This sets NXTLIN to hl */
+    0xc3, 0x6c, 0x06,       /* jp 0x066c        This sets NXTLIN to hl */
+    /* SEGS: copy the b segments in the table at hl to de on, skipping the
+       ones with a length of zero. de is left after the last byte copied. */
+    0xc5,                   /* SEGS: push bc */
+    0x4e,                   /* ld c,(hl) */
+    0x23,                   /* inc hl */
+    0x46,                   /* ld b,(hl) */
+    0x23,                   /* inc hl */
+    0xc5,                   /* push bc          Segment source address */
+    0x4e,                   /* ld c,(hl) */
+    0x23,                   /* inc hl */
+    0x46,                   /* ld b,(hl)        bc = segment length */
+    0x23,                   /* inc hl */
+    0xe3,                   /* ex (sp),hl       hl = source, the next segment on the stack */
+    0x78,                   /* ld a,b */
+    0xb1,                   /* or c */
+    0x28, 0x02,             /* jr z, +2         Skip copy for bc==0 */
+    0xed, 0xb0,             /* ldir             Copy the segment */
+    0xe1,                   /* pop hl           The next segment */
+    0xc1,                   /* pop bc */
+    0x10, 0xeb,             /* djnz SEGS */
+    0xc9                    /* ret */
 };
 
-ADDR ldr1_size = sizeof(ldr1); /* Currently $00b6 */
+ADDR ldr1_size = sizeof(ldr1); /* Currently $00aa */
 
 BYTE ldrp[] = {
     0x01, 0x00, 0x00,       /* ld bc, $0000 (So byte 0 contains 0x01) */
@@ -241,25 +249,277 @@ BYTE ldrp[] = {
     0x36, 0x3e,             /* ld (hl),0x3e     Put 0x3e at the top of BASIC RAM */
     0x2b,                   /* dec hl */
     0xf9,                   /* ld sp,hl         Point sp just below that */
-    0x2a, 0x41, 0x20,       /* ld hl,(PROG1S)   Get block source from rom */
+    0x21, 0x49, 0x20,       /* ld hl,PROGSEG    Program block segments */
     0x11, 0x09, 0x40,       /* ld de,0x4009     Set block destination to start of saved system variables (16393) */
-    0xed, 0x4b, 0x43, 0x20, /* ld bc,(PROG1L)   Get length of block to copy */
-    0xed, 0xb0,             /* ldir             Copy first program block */
-    /* Check for second prog block to copy and copy it */
-    0xed, 0x4b, 0x47, 0x20, /* ld bc,(PROG2L)  Load bc with length of 2nd program block */
+    0x06, 0x03,             /* ld b,ROMS */
+    0xcd, 0x33, 0x20,       /* call SEGS        Copy the program block */
+    0xcd, 0xad, 0x14,       /* call 0x14ad      CURSOR-IN: sets up lower screen to 2 lines and clear calc stack (uses hl) */
+    0xcd, 0x07, 0x02,       /* call 0x0207      SLOW/FAST: test CDFLAG bit 6 to set mode (uses hl, a, b) */
+    0x2a, 0x29, 0x40,       /* ld hl,(NXTLIN)   Address of next line to interpret */
+    /* Start BASIC interpreter */
+    0xc3, 0x6c, 0x06,       /* jp 0x066c        This sets NXTLIN to hl and saves it in de */
+    /* SEGS, as in ldr1 */
+    0xc5,                   /* SEGS: push bc */
+    0x4e,                   /* ld c,(hl) */
+    0x23,                   /* inc hl */
+    0x46,                   /* ld b,(hl) */
+    0x23,                   /* inc hl */
+    0xc5,                   /* push bc          Segment source address */
+    0x4e,                   /* ld c,(hl) */
+    0x23,                   /* inc hl */
+    0x46,                   /* ld b,(hl)        bc = segment length */
+    0x23,                   /* inc hl */
+    0xe3,                   /* ex (sp),hl       hl = source, the next segment on the stack */
     0x78,                   /* ld a,b */
     0xb1,                   /* or c */
-    0x28, 0x05,             /* jr z, +0x0D      Skip for bc==0 */
-    0x2a, 0x45, 0x20,       /* ld hl,(PROG2S) */
-    0xed, 0xb0,             /* ldir             Copy program block 2 */
+    0x28, 0x02,             /* jr z, +2         Skip copy for bc==0 */
+    0xed, 0xb0,             /* ldir             Copy the segment */
+    0xe1,                   /* pop hl           The next segment */
+    0xc1,                   /* pop bc */
+    0x10, 0xeb,             /* djnz SEGS */
+    0xc9                    /* ret */
+};
+
+ADDR ldrp_size = sizeof(ldrp); /* Currently 73 */
+
+/* With -z, the blocks are packed as a series of tokens:
+ *
+ *   $00                end of the segment
+ *   $01-$7F n          n literal bytes follow
+ *   $80-$FF lo hi      copy (token & $7F) + 3 bytes from hi*256+lo bytes back
+ *
+ * so a segment unpacks where the last one stopped, and can copy from it. The
+ * SEGS routine of the loaders calls DEPACK, which follows them, with hl = the
+ * packed segment and de = where to unpack it, in place of its LDIR, and their
+ * table follows DEPACK. The lengths in the table are of the unpacked bytes.
+ */
+BYTE depack[] = {
+    0x7e,                   /* DEPACK: ld a,(hl) Get a token */
+    0x23,                   /* inc hl */
+    0xb7,                   /* or a */
+    0x28, 0x23,             /* jr z,DONE        $00 ends the segment */
+    0xfe, 0x80,             /* cp 0x80 */
+    0x30, 0x07,             /* jr nc,MATCH */
+    0x4f,                   /* ld c,a           bc = number of literals */
+    0x06, 0x00,             /* ld b,0 */
+    0xed, 0xb0,             /* ldir             Copy them */
+    0x18, 0xf0,             /* jr DEPACK */
+    0xe6, 0x7f,             /* MATCH: and 0x7f */
+    0xc6, 0x03,             /* add a,3 */
+    0x4f,                   /* ld c,a           bc = length of the match */
+    0x06, 0x00,             /* ld b,0 */
+    0x7e,                   /* ld a,(hl)        Low byte of the distance */
+    0x23,                   /* inc hl */
+    0xe5,                   /* push hl */
+    0x66,                   /* ld h,(hl)        High byte */
+    0x6f,                   /* ld l,a */
+    0xd5,                   /* push de */
+    0xeb,                   /* ex de,hl */
+    0xb7,                   /* or a */
+    0xed, 0x52,             /* sbc hl,de        hl = de - distance */
+    0xd1,                   /* pop de */
+    0xed, 0xb0,             /* ldir             Copy from what is already unpacked */
+    0xe1,                   /* pop hl */
+    0x23,                   /* inc hl           Past the high byte */
+    0x18, 0xd8,             /* jr DEPACK */
+    0xc9                    /* DONE: ret        de is the end of what was unpacked */
+};
+
+ADDR depack_size = sizeof(depack); /* 41 */
+
+/* ldr1 with SEGS calling DEPACK at $20ab, with its table after at $20d4
+ * (p2ts1510_loader.a80 with PACKED set)
+ */
+BYTE ldr1z[] = {
+    0x01, 0x00, 0x00,       /* ld bc, $0000 (So byte 0 contains 0x01) */
+    0xd3, 0xfd,             /* out (0fdh),a */
+    0xf3,                   /* di */
+    /* This appears to be clearing RAM from RAMTOP-1 down to $4000, which includes */
+    /* the system variables, so we have to save RAMTOP in de register to put back after. */
+    0x2a, 0x04, 0x40,       /* ld hl,(RAMTOP) */
+    0x54,                   /* ld d,h  Copy RAMTOP to de */
+    0x5d,                   /* ld e,l */
+    0x2b,                   /* dec hl           hl = RAMTOP-1 */
+    0x3e, 0x3f,             /* ld a,0x3f        High-byte val to check on hl */
+    0x36, 0x00,             /* ld (hl),0x00     Store $00 there */
+    0x2b,                   /* dec hl */
+    0xbc,                   /* cp h             Loop until hl=$3fff (h=$3f) */
+    0x20, 0xfa,             /* jr nz -6 */
+    0xeb,                   /* ex de,hl         Get RAMTOP back from de */
+    0x22, 0x04, 0x40,       /* ld (04004h),hl   Set RAMTOP back after clearing sys vars area */
+    /* Set up stack */
+    0x2b,                   /* dec hl           hl = RAMTOP-1 */
+    0x36, 0x3e,             /* ld (hl),0x3e     Put $3e at top of BASIC RAM */
+    0x2b,                   /* dec hl */
+    0xf9,                   /* ld sp,hl         Point sp just below that */
+    0x2b,                   /* dec hl */
+    0x2b,                   /* dec hl */
+    0x22, 0x02, 0x40,       /* ld (ERR_SP),hl   Set address of first item on machine stack */
+    /* Other setup */
+    0x3e, 0x1e,             /* ld a,0x1e */
+    0xed, 0x47,             /* ld i,a */
+    0xed, 0x56,             /* im 1 */
+    0xfd, 0x21, 0x00, 0x40, /* ld iy,0x4000     Set index to start of RAM */
+    0x3a, 0xf2, 0x20,       /* ld a,(PCDFLAG)   Get CDFLAG value stored after the loader */
+    0xfd, 0x77, 0x3b,       /* ld (iy+03bh),a   Set CDFLAG */
+    0x21, 0xd4, 0x20,       /* ld hl,PROGSEG    Program block segments */
+    0x11, 0x7d, 0x40,       /* ld de,0x407d     Set block destination to start of program (16509) */
+    0x06, 0x03,             /* ld b,ROMS */
+    0xcd, 0x94, 0x20,       /* call SEGS        Unpack the program block */
+    0xeb,                   /* ex de,hl         hl = de, which is dest byte after program (D_FILE should start there) */
+    0x22, 0x0c, 0x40,       /* ld (D_FILE),hl   Set D_FILE location to be after the program */
+    0x06, 0x19,             /* ld b,0x19        Set it up as 25 newlines */
+    0x3e, 0x76,             /* ld a,NEWLINE */
+    0x77,                   /* ld (hl),a        for a collapsed display file. */
+    0x23,                   /* inc hl */
+    0x10, 0xfc,             /* djnz -4 */
+    0x22, 0x10, 0x40,       /* ld (VARS),hl     Point VARS to just after display file */
+    0xcd, 0x9a, 0x14,       /* call 0x149a  CLEAR: clears the variable area (sets hl and E_LINE) */
+    0xcd, 0xad, 0x14,       /* call 0x14ad  CURSOR-IN: sets up lower screen to 2 lines and clear calc stack (uses hl) */
+    0xcd, 0x07, 0x02,       /* call 0x0207  SLOW/FAST: test CDFLAG bit 6 to set mode (uses hl, a, b) */
+    0xcd, 0x2a, 0x0a,       /* call 0x0a2a  CLS: will expand a collapsed display file if enough RAM (uses bc, a, hl, de) */
+    0xed, 0x4b, 0xec, 0x20, /* ld bc,(VARSLEN)  Get the total vars length */
+    /* If bc==0, no vars block, so skip vars loading */
+    0x78,                   /* ld a,b */
+    0xb1,                   /* or c */
+    0x28, 0x11,             /* jr z, +0x11      Skip vars copy for bc==0 */
+    0x2a, 0x14, 0x40,       /* ld hl,(E_LINE)   Get new E_LINE */
+    0x2b,                   /* dec hl           why? Point to the $80 at end of empty vars? */
+    0xcd, 0x9e, 0x09,       /* call 0x099e      Making room for the vars block */
+    0x23,                   /* inc hl           hl must point to VARS-1 after? */
+    0xeb,                   /* ex de,hl		    de=hl to set the destination (VARS) for the vars block */
+    0x21, 0xe0, 0x20,       /* ld hl,VARSSEG    Variables block segments */
+    0x06, 0x03,             /* ld b,ROMS */
+    0xcd, 0x94, 0x20,       /* call SEGS        Unpack the vars block */
+    /* All done copying, set auto start */
+    0xed, 0x4b, 0xf0, 0x20, /* ld bc,(AUTOLN)   Get program line to start */
+    0xed, 0x5b, 0xee, 0x20, /* ld de,(AUTOAD)   Get program address to start **** This needs to be NXTLIN because */
+    0x62,                   /* ld h,d hl=de     For call to NEXT-LINE later     **** we dec de to set CH_ADD with it */
+    0x6b,                   /* ld l,e */
+    0x1b,                   /* dec de           CH_ADD points one less than you would think */
+    0xed, 0x53, 0x16, 0x40, /* ld (CH_ADD),de   Set address of next char to be interpreted */
+    0xed, 0x43, 0x07, 0x40, /* ld (PPC),bc      Set line number of statement being executed */
+    /* Set STKEND and FLAGS */
+    0xfd, 0x36, 0x22, 0x02, /* ld (iy+022h),0x02  Load DF_SZ with 2 lines for lower screen */
+    0xfd, 0x36, 0x01, 0x80, /* ld (iy+001h),080h  Load FLAGS,$80 */
+    /* Start BASIC interpreter */
+    0x3e, 0xff,             /* ld a,0xff */
+    0x32, 0x7c, 0x40,       /* ld (16508),a     Why are we setting the unused byte before the program to $FF? */
+    0xc3, 0x6c, 0x06,       /* jp 0x066c        This sets NXTLIN to hl */
+    /* SEGS, unpacking each segment */
+    0xc5,                   /* SEGS: push bc */
+    0x4e,                   /* ld c,(hl) */
+    0x23,                   /* inc hl */
+    0x46,                   /* ld b,(hl) */
+    0x23,                   /* inc hl */
+    0xc5,                   /* push bc          Segment source address */
+    0x4e,                   /* ld c,(hl) */
+    0x23,                   /* inc hl */
+    0x46,                   /* ld b,(hl)        bc = segment length */
+    0x23,                   /* inc hl */
+    0xe3,                   /* ex (sp),hl       hl = source, the next segment on the stack */
+    0x78,                   /* ld a,b */
+    0xb1,                   /* or c */
+    0x28, 0x03,             /* jr z, +3         Skip for bc==0 */
+    0xcd, 0xab, 0x20,       /* call DEPACK      Unpack the segment */
+    0xe1,                   /* pop hl           The next segment */
+    0xc1,                   /* pop bc */
+    0x10, 0xea,             /* djnz SEGS */
+    0xc9                    /* ret */
+};
+
+ADDR ldr1z_size = sizeof(ldr1z); /* 171 */
+
+/* ldrp with SEGS calling DEPACK at $204a, with its table after at $2073
+ * (p2ts1510_loader-tape.a80 with PACKED set)
+ */
+BYTE ldrpz[] = {
+    0x01, 0x00, 0x00,       /* ld bc, $0000 (So byte 0 contains 0x01) */
+    0xd3, 0xfd,             /* out (0fdh),a */
+    0xf3,                   /* di */
+    /* Other setup */
+    0x3e, 0x1e,             /* ld a,0x1e */
+    0xed, 0x47,             /* ld i,a */
+    0xed, 0x56,             /* im 1 */
+    0xfd, 0x21, 0x00, 0x40, /* ld iy,0x4000     Set index to start of RAM */
+    0xfd, 0x36, 0x01, 0x80, /* ld (iy+001h),080h  Load FLAGS with $80 */
+    0x2a, 0x04, 0x40,       /* ld hl,(RAMTOP) */
+    0x2b,                   /* dec hl */
+    0x36, 0x3e,             /* ld (hl),0x3e     Put 0x3e at the top of BASIC RAM */
+    0x2b,                   /* dec hl */
+    0xf9,                   /* ld sp,hl         Point sp just below that, DEPACK needs the stack */
+    0x21, 0x73, 0x20,       /* ld hl,PROGSEG    Program block segments */
+    0x11, 0x09, 0x40,       /* ld de,0x4009     Set block destination to start of saved system variables (16393) */
+    0x06, 0x03,             /* ld b,ROMS */
+    0xcd, 0x33, 0x20,       /* call SEGS        Unpack the program block */
     0xcd, 0xad, 0x14,       /* call 0x14ad      CURSOR-IN: sets up lower screen to 2 lines and clear calc stack (uses hl) */
     0xcd, 0x07, 0x02,       /* call 0x0207      SLOW/FAST: test CDFLAG bit 6 to set mode (uses hl, a, b) */
     0x2a, 0x29, 0x40,       /* ld hl,(NXTLIN)   Address of next line to interpret */
     /* Start BASIC interpreter */
-    0xc3, 0x6c, 0x06        /* jp 0x066c        This sets NXTLIN to hl and saves it in de */
+    0xc3, 0x6c, 0x06,       /* jp 0x066c        This sets NXTLIN to hl and saves it in de */
+    /* SEGS, as in ldr1z */
+    0xc5,                   /* SEGS: push bc */
+    0x4e,                   /* ld c,(hl) */
+    0x23,                   /* inc hl */
+    0x46,                   /* ld b,(hl) */
+    0x23,                   /* inc hl */
+    0xc5,                   /* push bc          Segment source address */
+    0x4e,                   /* ld c,(hl) */
+    0x23,                   /* inc hl */
+    0x46,                   /* ld b,(hl)        bc = segment length */
+    0x23,                   /* inc hl */
+    0xe3,                   /* ex (sp),hl       hl = source, the next segment on the stack */
+    0x78,                   /* ld a,b */
+    0xb1,                   /* or c */
+    0x28, 0x03,             /* jr z, +3         Skip for bc==0 */
+    0xcd, 0x4a, 0x20,       /* call DEPACK      Unpack the segment */
+    0xe1,                   /* pop hl           The next segment */
+    0xc1,                   /* pop bc */
+    0x10, 0xea,             /* djnz SEGS */
+    0xc9                    /* ret */
 };
 
-ADDR ldrp_size = sizeof(ldrp); /* Currently 73 */
+ADDR ldrpz_size = sizeof(ldrpz); /* 74 */
+
+/* The packing of the blocks for -z. lzParse() finds the packing of a block
+ * that takes the fewest bytes, working back from its end, with the longest
+ * match at each offset found through chains of the earlier offsets with the
+ * same hash of their first 3 bytes.
+ */
+#define LZ_MINMATCH 3
+#define LZ_MAXMATCH 130
+#define LZ_MAXLIT   127
+#define LZ_HASH     4096
+#define LZ_DEPTH    1024    /* Most offsets to try for a match */
+
+ROMP lzCost[BUFFSZ+1];  /* Bytes to pack the rest of the block from each offset */
+BYTE lzLen[BUFFSZ];     /* Length of the token that starts there */
+ADDR lzDist[BUFFSZ];    /* and the distance back of a match, 0 for literals */
+ROMP lzHead[LZ_HASH];
+ROMP lzPrev[BUFFSZ];    /* The previous offset with the same hash */
+BYTE zbuf[ROMS*ROM8K];  /* The packed segments */
+ADDR zbufUsed = 0;
+long lzPacked = 0;      /* Bytes of the packed segments */
+long lzUnpacked = 0;    /* and of the blocks */
+long lzTstates = 0;     /* Estimated time for DEPACK to unpack them */
+
+typedef struct
+    {
+    BYTE *data;
+    ADDR size;
+    ADDR pos;           /* Next byte to pack */
+    ADDR lit;           /* Literals left of a run split between segments */
+    } LZBLOCK;
+
+/* A block is laid out in ROM as a segment in each ROM it reaches */
+typedef struct
+    {
+    int rom;            /* Which ROM, 0 for ROM A */
+    ADDR addr;          /* Where the segment is in memory */
+    ADDR len;           /* Bytes of the block it holds */
+    ADDR size;          /* Bytes it takes in the ROM, fewer than len if packed */
+    BYTE *src;          /* What goes in the ROM */
+    } SEGMENT;
 
 BYTE *ldr;       /* Point to selected loader source */
 ADDR loaderSize; /* Size of the loader selected */
@@ -371,6 +631,7 @@ void printUsage ()
     printf("  -i          Print the P file and block info but don't output the ROMs.\n");
     printf("  -p          Use prog+vars loader: no sys vars or display file.\n");
     printf("  -t          Use tape-like loader: includes sys vars & display (default).\n");
+    printf("  -z          Pack the program with LZ and unpack it in the loader.\n");
     printf("  -?          Print this help.\n");
     printf("The default output file name is taken from the input file name.\n");
     printf("The input can be standard input or you can give '-' as the file name.\n");
@@ -420,6 +681,9 @@ void parseOptions (int argc, char *argv[])
             case 'p':
                 tapeLikeLoader = 0; /* Program+vars loader */
                 break;
+            case 'z':
+                compress = 1;
+                break;
             case '?':
                 printUsage();
                 exit(EXIT_SUCCESS);
@@ -483,22 +747,16 @@ ROMP findLine (LINENUM line)
     /* Search buff for the offset of a given line number or the next line after */
     /* Returns -1 if line is greater than the last line */
 
-    ROMP inext = PROGRAM - SYSSAVE; /* next line offset  */
-    ROMP ithis;       /* current line offset  */
-    LINENUM thisline; /* current line number */
-    ROMP prog_end = PROGRAM - SYSSAVE + prog_size;
+    PITER it;
+    PLINE l;
 
-    do  {
-        ithis = inext;
-        thisline = 256 * buff[ithis] + buff[ithis+1];
-        inext = ithis + buff[ithis+2] + 256 * buff[ithis+3] + 4;
+    pfileStart(&it, &pf);
+    while (pfileNext(&it, &l))
+        {
+        if (line <= (LINENUM)l.num)
+            return l.offset;
         }
-    while (line > thisline && inext < prog_end);
-
-    if (line <= thisline)
-        return ithis;
-    else
-        return -1;
+    return -1;
 }
 
 
@@ -545,6 +803,203 @@ void romStoreAddr (ROMP i, ADDR addr)
 }
 
 
+ROMP lzMatch (BYTE *d, ADDR n, ROMP i, ADDR *dist)
+{
+    /* Length of the longest match for offset i, or 0 if under LZ_MINMATCH */
+
+    ROMP j, k, best = 0;
+    ROMP max = n - i < LZ_MAXMATCH ? n - i : LZ_MAXMATCH;
+    int depth = 0;
+
+    if (max < LZ_MINMATCH)
+        return 0;
+    for (j = lzPrev[i]; j >= 0 && depth < LZ_DEPTH && best < max; j = lzPrev[j], depth++)
+        {
+        for (k = 0; k < max && d[j+k] == d[i+k]; k++)
+            ;
+        if (k > best)
+            {
+            best = k;
+            *dist = i - j;
+            }
+        }
+    return best >= LZ_MINMATCH ? best : 0;
+}
+
+void lzParse (BYTE *d, ADDR n)
+{
+    /* Choose the tokens to pack the n bytes at d in */
+
+    ROMP i, k, len, best, c;
+    ADDR dist = 0, mdist = 0;
+    unsigned h;
+
+    for (i = 0; i < LZ_HASH; i++)
+        lzHead[i] = -1;
+    for (i = 0; i + 2 < (ROMP)n; i++)
+        {
+        h = (d[i] * 1089u + d[i+1] * 33u + d[i+2]) & (LZ_HASH - 1);
+        lzPrev[i] = lzHead[h];
+        lzHead[h] = i;
+        }
+    lzCost[n] = 1; /* The end marker */
+    for (i = n - 1; i >= 0; i--)
+        {
+        best = 32767;
+        len = 0;
+        for (k = 1; k <= LZ_MAXLIT && i + k <= (ROMP)n; k++)
+            {
+            c = 1 + k + lzCost[i+k];
+            if (c < best)
+                {
+                best = c;
+                len = k;
+                dist = 0;
+                }
+            }
+        for (k = lzMatch(d, n, i, &mdist); k >= LZ_MINMATCH; k--)
+            {
+            c = 3 + lzCost[i+k];
+            if (c < best)
+                {
+                best = c;
+                len = k;
+                dist = mdist;
+                }
+            }
+        lzCost[i] = best;
+        lzLen[i] = len;
+        lzDist[i] = dist;
+        }
+}
+
+ADDR lzWrite (LZBLOCK *b, BYTE *out, ADDR room, ADDR *used)
+{
+    /* Write a segment of the block parsed by lzParse() from where it got to,
+     * up to its end or the room, with the end marker. Returns how many bytes
+     * of the block it holds, and the bytes written in *used.
+     */
+
+    ADDR n = 0, start = b->pos, len;
+
+    while (b->pos < b->size)
+        {
+        if (b->lit || lzDist[b->pos] == 0)
+            {
+            len = b->lit ? b->lit : lzLen[b->pos];
+            if (n + 3 > room)
+                break;
+            b->lit = 0;
+            if (n + 2 + len > room)
+                {
+                /* Split the run, the rest going in the next segment */
+                b->lit = len - (room - n - 2);
+                len = room - n - 2;
+                }
+            out[n++] = len;
+            memcpy(out + n, b->data + b->pos, len);
+            n += len;
+            b->pos += len;
+            lzTstates += 56 + 21L * len;
+            if (b->lit)
+                break;
+            }
+        else
+            {
+            if (n + 4 > room)
+                break;
+            len = lzLen[b->pos];
+            out[n++] = 0x80 | (len - LZ_MINMATCH);
+            out[n++] = lzDist[b->pos] & 0xFF;
+            out[n++] = lzDist[b->pos] >> 8;
+            b->pos += len;
+            lzTstates += 170 + 21L * len;
+            }
+        }
+    out[n++] = 0;
+    lzTstates += 39;
+    lzPacked += n;
+    lzUnpacked += b->pos - start;
+    *used = n;
+    return b->pos - start;
+}
+
+int layBlock (SEGMENT *seg, BYTE *data, ADDR size, int *r, ADDR *used)
+{
+    /* Lay out a block of size bytes after the *used bytes of ROM *r, filling
+     * that ROM and going on into the next ones, packed for -z. Returns the
+     * number of segments, or -1 if it runs past the last ROM.
+     */
+
+    int n = 0;
+    ADDR done = 0, room;
+    LZBLOCK zb;
+
+    if (compress)
+        {
+        lzParse(data, size);
+        zb.data = data;
+        zb.size = size;
+        zb.pos = zb.lit = 0;
+        }
+    while (done < size)
+        {
+        room = ROM8K - *used;
+        if (room < (compress ? 4 : 1)) /* Room for a token of the packed block */
+            {
+            if (++*r == ROMS)
+                return -1;
+            *used = 0;
+            continue;
+            }
+        seg[n].rom = *r;
+        seg[n].addr = romOrg[*r] + *used;
+        if (compress)
+            {
+            seg[n].src = zbuf + zbufUsed;
+            seg[n].len = lzWrite(&zb, seg[n].src, room, &seg[n].size);
+            zbufUsed += seg[n].size;
+            }
+        else
+            {
+            seg[n].src = data + done;
+            seg[n].len = size - done < room ? size - done : room;
+            seg[n].size = seg[n].len;
+            }
+        done += seg[n].len;
+        *used += seg[n].size;
+        n++;
+        }
+    return n;
+}
+
+void romStoreSegs (ROMP i, SEGMENT *seg, int n)
+{
+    /* Store the address and length of each segment of a block in the table,
+     * with a length of zero for the ROMs it doesn't reach */
+
+    int s;
+
+    for (s = 0; s < ROMS; s++)
+        {
+        romStoreAddr(i + 4 * s, s < n ? seg[s].addr : 0);
+        romStoreAddr(i + 4 * s + 2, s < n ? seg[s].len : 0);
+        }
+}
+
+void printSegs (SEGMENT *seg, int n, char *what)
+{
+    int s;
+
+    for (s = 0; s < n; s++)
+        {
+        fprintf(stderr, "%5d ($%04x-%04x): %5d ($%04x) bytes, %s", seg[s].addr, seg[s].addr, seg[s].addr + seg[s].size - 1, seg[s].size, seg[s].size, what);
+        if (n > 1)
+            fprintf(stderr, " segment %d", s + 1);
+        fprintf(stderr, " in ROM\n");
+        }
+}
+
 int lineNum(BYTE b1, BYTE b2)
 {
     return 256 * b1 + b2; /* High byte first */
@@ -552,23 +1007,21 @@ int lineNum(BYTE b1, BYTE b2)
 
 void printLine (FILE* f, ADDR lineAddr)
 {
-    ROMP x = lineAddr - SYSSAVE;
+    PLINE l;
+    ROMP x;
     ROMP len;
-    ROMP end;
-    BYTE c;
+    BYTE c = NEWLINE;
 
-    if (x < 0 || x > pfile_size)
+    if (lineAddr < SYSSAVE || lineAddr - SYSSAVE > pfile_size || !pfileLineAt(&pf, lineAddr - SYSSAVE, &l))
         {
         /* Address is outside the P file */
         return;
         }
-    len = dpeek(lineAddr+2);
-    len = len < 256 ? len : 256; /* Limit length */
-    end = x + 4 + len;
-    fprintf(f, " %5d", lineNum(buff[x], buff[x+1]));
-    for (x += 4; x < end; x++)
+    len = l.len < 256 ? l.len : 256; /* Limit length */
+    fprintf(f, " %5d", l.num);
+    for (x = 0; x < len; x++)
         {
-        c = buff[x];
+        c = l.text[x];
         if (c == 0x7E) /* Number */
             {
             x += 5;
@@ -594,17 +1047,10 @@ int main (int argc, char *argv[])
     ADDR eline, ch_add, nxtlin;
     ADDR autoaddr;
     LINENUM autoline;
-    ADDR prog1len = 0;
-    ADDR vars1len = 0;
-    ADDR prog1offs = 0;
-    ADDR prog1addr = 0;
-    ADDR vars1addr = 0;
-    ADDR prog2addr = 0;
-    ADDR vars2addr = 0;
-    ADDR vars1offs = 0;
-    ADDR prog2len = 0;
-    ADDR vars2len = 0;
-    ADDR prog2offs = 0;
+    SEGMENT progSeg[ROMS], varsSeg[ROMS];
+    int nprog, nvars = 0;
+    int r = 0, s;
+    ADDR used;
     char R[] = "_A";
     int autorun_warn = 0;
     int autorun_check = 0;
@@ -676,25 +1122,28 @@ int main (int argc, char *argv[])
 
     if (tapeLikeLoader)
         {
-        ldr = ldrp;
-        loaderSize = ldrp_size;
-        dataOffset = ldrp_size + 0x08;
+        ldr = compress ? ldrpz : ldrp;
+        loaderSize = compress ? ldrpz_size : ldrp_size;
         includeVars = 1; /* vars are included with everything */
         prg = buff; /* whole thing is the program block */
         }
     else
         {
-        ldr = ldr1;
-        loaderSize = ldr1_size;
-        dataOffset = ldr1_size + 0x15;
+        ldr = compress ? ldr1z : ldr1;
+        loaderSize = compress ? ldr1z_size : ldr1_size;
         prg = buff + PROGRAM - SYSSAVE;
         }
 
-    sizeLimit = ROM8K - dataOffset; /* Space in ROM A for data */
-
-    /* Copy the loader to the ROM image */
+    /* Copy the loader to the ROM image, with DEPACK after it to unpack */
     memset(rom, 0xFF, ROM8K);
     memcpy(rom, ldr, loaderSize);
+    if (compress)
+        {
+        memcpy(rom + loaderSize, depack, depack_size);
+        loaderSize += depack_size;
+        }
+    dataOffset = loaderSize + (tapeLikeLoader ? VARSSEG : PCDFLAG + 1); /* After the table */
+    sizeLimit = ROM8K - dataOffset; /* Space in ROM A for data */
 
     /* Load the .P file */
 
@@ -705,6 +1154,7 @@ int main (int argc, char *argv[])
         buff[f] = c;
         }
     pfile_size = f; /* Actual size, but can contain extra bytes beyond vars */
+    pfileBuffer(&pf, buff, pfile_size);
 
     if (buff[0] != 0)
         {
@@ -798,143 +1248,6 @@ int main (int argc, char *argv[])
         printLine(stderr, nxtlin);
         }
 
-    /* Work out program and variable blocks for storing in ROM */
-
-    prog1offs = dataOffset;
-    prog1addr = ORGA + dataOffset;
-
-    if (tapeLikeLoader)
-        {
-        /* Put whole P file in ROM and the loader loads it all. 
-         * The whole thing will be in prog1 and (possibly) prog2 blocks.
-         */
-        if (pfile_size > sizeLimit)
-            {
-            /* P file is split across ROMs */
-            prog1len = sizeLimit;
-            prog2len  = pfile_size - prog1len;
-            prog2addr = ORGB; /* 2nd part starts on ROM B */
-            prog2offs = 0;
-            if (prog2len > ROM8K)
-                {
-                fprintf(stderr, "Error: P file size is larger than two 8K ROMs.\n");
-                cleanup();
-                exit(EXIT_FAILURE);
-                }
-            if (!oneRom)
-                strcat(outroot, R);
-            }
-        else /* Fits in the one ROM */
-            {
-            prog1len  = pfile_size;
-            prog2len  = 0;
-            }
-        }
-    else if (prog_size > sizeLimit)
-        {
-        /* Program is split */
-        prog1len  = sizeLimit;
-        prog2len  = prog_size - prog1len;
-        prog2addr = ORGB; /* 2nd part starts on ROM B */
-        prog2offs = 0;
-        /* Vars are not split but are on ROM B */
-        if (includeVars)
-            {
-            if (prog2len + vars_size > ROM8K)
-                {
-                fprintf(stderr, "Error: Program + variables size is larger than two 8K ROMs.\n");
-                cleanup();
-                exit(EXIT_FAILURE);
-                }
-            vars1len  = vars_size;
-            vars2len  = 0;
-            vars1offs = prog2offs + prog2len;
-            vars1addr = prog2addr + prog2len;
-            }
-        else if (prog2len > ROM8K)
-            {
-            fprintf(stderr, "Error: Program size is larger than two 8K ROMs.\n");
-            cleanup();
-            exit(EXIT_FAILURE);
-            }
-        if (!oneRom)
-            strcat(outroot, R);
-        }
-    else
-        {
-        /* Program is not split */
-        prog1len  = prog_size;
-        prog2len  = 0;
-        prog2offs = 0;
-        prog2addr = 0;
-        if (includeVars)
-            {
-            if (vars_size > sizeLimit - prog_size)
-                {
-                /* Vars are split */
-                vars1len  = sizeLimit - prog_size;
-                vars2len  = vars_size - vars1len;
-                vars1offs = prog1offs + prog_size;
-                vars1addr = prog1addr + prog_size;
-                vars2addr = ORGB;
-                if (vars2len > ROM8K)
-                    {
-                    fprintf(stderr, "Error: Program + variables size is larger than two 8K ROMs.\n");
-                    cleanup();
-                    exit(EXIT_FAILURE);
-                    }
-                if (!oneRom)
-                    strcat(outroot, R);
-                }
-            else
-                {
-                /* Vars are not split */
-                vars1len  = vars_size;
-                vars2len  = 0;
-                vars1addr = prog1addr + prog1len;
-                vars1offs = prog1offs + prog1len;
-                }
-            }
-        }
-
-    /* Set block info in ROM */
-
-    fprintf(stderr, "ROM --------------------------------------------------\n");
-    fprintf(stderr ," 8192 ($2000-%04x): %5d ($%04x) bytes, %s loader in ROM\n", 0x2000 + dataOffset - 1, dataOffset, dataOffset, ldr_type[tapeLikeLoader]);
-    if (!tapeLikeLoader)
-        {
-        rom[loaderSize + PCDFLAG] = cdflag;
-        romStoreAddr(VARS2L, vars2len);     /* Length  of 2nd variables block */
-        romStoreAddr(VARS2S, vars2addr);    /* Address of 2nd variables block */
-        romStoreAddr(VARS1L, vars1len);     /* Length  of 1st variables block */
-        romStoreAddr(VARS1S, vars1addr);    /* Address of 1st variables block */
-        }
-    romStoreAddr(PROG2L, prog2len);     /* Length  of 2nd program block */
-    romStoreAddr(PROG2S, prog2addr);    /* Address of 2nd program block */
-    romStoreAddr(PROG1L, prog1len);     /* Length  of 1st program block */
-    romStoreAddr(PROG1S, prog1addr);    /* Address of 1st program block */
-
-
-
-    if (prog2len)
-        {
-        fprintf(stderr, "%5d ($%04x-%04x): %5d ($%04x) bytes, Program segment 1 in ROM\n", prog1addr, prog1addr, prog1addr + prog1len - 1, prog1len, prog1len);
-        fprintf(stderr, "%5d ($%04x-%04x): %5d ($%04x) bytes, Program segment 2 in ROM\n", prog2addr, prog2addr, prog2addr + prog2len - 1, prog2len, prog2len);
-        }
-    else
-        fprintf(stderr, "%5d ($%04x-%04x): %5d ($%04x) bytes, Program in ROM\n", prog1addr, prog1addr, prog1addr + prog1len - 1, prog1len, prog1len);
-
-    if (vars1len > 0)
-        {
-        if (vars2len)
-            {
-            fprintf(stderr, "%5d ($%04x-%04x): %5d ($%04x) bytes, Variables segment 1 in ROM\n", vars1addr, vars1addr, vars1addr + vars1len - 1, vars1len, vars1len);
-            fprintf(stderr, "%5d ($%04x-%04x): %5d ($%04x) bytes, Variables segment 2 in ROM\n", vars2addr, vars2addr, vars2addr + vars2len - 1, vars2len, vars2len);
-            }
-        else
-            fprintf(stderr, "%5d ($%04x-%04x): %5d ($%04x) bytes, Variables in ROM\n", vars1addr, vars1addr, vars1addr + vars1len - 1, vars1len, vars1len);
-        }
-
     /* Sort out the autorun address and line number */
 
     if (autorun < 0) /* No autorun forced by '-a -1' option */
@@ -1126,6 +1439,53 @@ int main (int argc, char *argv[])
             }
         }
 
+    /* Work out program and variable blocks for storing in ROM */
+
+    /* Lay out the program block (the whole P file for the tape-like loader)
+     * after the loader in ROM A, going on into ROM B and C when it fills each,
+     * and then the vars block after it. With -z they are packed, after the
+     * autorun is set in the system variables.
+     */
+    used = dataOffset;
+    nprog = layBlock(progSeg, prg, tapeLikeLoader ? pfile_size : prog_size, &r, &used);
+    if (nprog >= 0 && includeVars && !tapeLikeLoader)
+        nvars = layBlock(varsSeg, var, vars_size, &r, &used);
+    if (nprog < 0 || nvars < 0)
+        {
+        if (compress)
+            fprintf(stderr, "Error: Packed P file is larger than three 8K ROMs.\n");
+        else if (tapeLikeLoader)
+            fprintf(stderr, "Error: P file size is larger than three 8K ROMs.\n");
+        else if (includeVars)
+            fprintf(stderr, "Error: Program + variables size is larger than three 8K ROMs.\n");
+        else
+            fprintf(stderr, "Error: Program size is larger than three 8K ROMs.\n");
+        cleanup();
+        exit(EXIT_FAILURE);
+        }
+    if (r > 0 && !oneRom)
+        strcat(outroot, R);
+
+    /* Set block info in ROM */
+
+    fprintf(stderr, "ROM --------------------------------------------------\n");
+    fprintf(stderr ," 8192 ($2000-%04x): %5d ($%04x) bytes, %s loader in ROM\n", 0x2000 + dataOffset - 1, dataOffset, dataOffset, ldr_type[tapeLikeLoader]);
+    if (!tapeLikeLoader)
+        {
+        rom[loaderSize + PCDFLAG] = cdflag;
+        romStoreAddr(VARSLEN, nvars ? vars_size : 0); /* Length of the whole variables block */
+        romStoreSegs(VARSSEG, varsSeg, nvars);  /* Variables block segments */
+        }
+    romStoreSegs(PROGSEG, progSeg, nprog);      /* Program block segments */
+
+    printSegs(progSeg, nprog, "Program");
+    printSegs(varsSeg, nvars, "Variables");
+    if (compress)
+        {
+        fprintf(stderr, "Packed %ld bytes to %ld (%ld%%), about %ld T-states to unpack (%ld to copy)\n",
+                lzUnpacked, lzPacked, lzUnpacked ? lzPacked * 100 / lzUnpacked : 0, lzTstates, 21 * lzUnpacked);
+        }
+
     if (!out)
         {
         strcpy(outname, outroot);
@@ -1142,52 +1502,13 @@ int main (int argc, char *argv[])
             }
         }
 
-    /* Copy program block 1 to rom */
-    memcpy(rom + dataOffset, prg, prog1len);
-    thisRomSize = dataOffset + prog1len;
-
-    if (prog2len > 0)
+    /* Copy the segments to each ROM in turn, ROM A having the loader */
+    thisRomSize = dataOffset;
+    for (c = 0; c <= r; c++)
         {
-        /* Prog is split, done with first 8K ROM */
-        writeROM(out, !oneRom);
-        if (oneRom)
-            {
-            prevRomSize += ROM8K;
-            }
-        else
+        if (c > 0)
             {
-            /* ROM B */
-            prevRomSize = 0;
-            c = strlen(outroot);
-            outroot[c-1]++; /* A->B */
-            strcpy(outname, outroot);
-            strcat(outname, outext);
-            if (!infoOnly)
-                {
-                fclose(out);
-                out = fopen(outname,"wb");
-                if (out == NULL)
-                    {
-                    fprintf(stderr, "Error: couldn't write output file '%s'\n", outname);
-                    cleanup();
-                    exit(EXIT_FAILURE);
-                    }
-                }
-            }
-        /* Write prog 2 block to rom */
-        memset(rom, 0xFF, ROM8K);
-        memcpy(rom, prg + prog1len, prog2len);
-        thisRomSize = prog2len;
-        }
-    
-    if (vars1len > 0)
-        {
-        /* Copy first block to rom */
-        memcpy(rom + vars1offs, var, vars1len);
-        thisRomSize = vars1offs + vars1len;
-        if (vars2len > 0)
-            {
-            /* Vars is split, done with first 8K ROM */
+            /* Done with the previous 8K ROM */
             writeROM(out, !oneRom);
             if (oneRom)
                 {
@@ -1195,21 +1516,16 @@ int main (int argc, char *argv[])
                 }
             else
                 {
-                /* Prepare ROM B file */
                 prevRomSize = 0;
-                c = strlen(outroot);
-                outroot[c-1]++; /* Change 'A' to 'B' */
+                f = strlen(outroot);
+                outroot[f-1]++; /* A->B, B->C */
                 strcpy(outname, outroot);
                 strcat(outname, outext);
-                if (infoOnly)
-                    {
-                    fprintf(stderr, "ROM: %s\n", outname);
-                    }
-                else
+                if (!infoOnly)
                     {
                     fclose(out);
                     out = fopen(outname,"wb");
-                    if ( out == NULL )
+                    if (out == NULL)
                         {
                         fprintf(stderr, "Error: couldn't write output file '%s'\n", outname);
                         cleanup();
@@ -1217,10 +1533,17 @@ int main (int argc, char *argv[])
                         }
                     }
                 }
-            /* Write vars 2 block to rom */
             memset(rom, 0xFF, ROM8K);
-            memcpy(rom, var + vars1len, vars2len);
-            thisRomSize = vars2len;
+            thisRomSize = 0;
+            }
+        for (s = 0; s < nprog + nvars; s++)
+            {
+            SEGMENT *g = s < nprog ? &progSeg[s] : &varsSeg[s - nprog];
+            if (g->rom == c)
+                {
+                memcpy(rom + g->addr - romOrg[c], g->src, g->size);
+                thisRomSize = g->addr - romOrg[c] + g->size;
+                }
             }
         }
 
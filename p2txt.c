@@ -8,19 +8,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <math.h>
 
-#define VERSION "1.0.2"
+#include "pfile.h"
+#include "outbuf.h"
+
+/* Files can be listed on several threads except on DOS */
+#ifndef __MSDOS__
+#define P2T_THREADS
+#include <pthread.h>
+#endif
+
+#define VERSION "1.1.0"
 
 #define QUOTE_code 11
 #define NUM_code 126
 #define REM_code 234
 
-unsigned char linebuf[32768]; /* BIG buffer for those lovely m/c REMs */
-char *infile;
-enum outstyle {OUT_READABLE, OUT_ZMAKEBAS, OUT_ZXTEXT2P};
+#define MAX_THREADS 64
+
+char **infiles;     /* Files to list */
+int ninfiles;
+char *listfile = NULL; /* File with more file names to list */
+char *outdir = NULL;   /* Directory for the listings, or NULL for stdout */
+int nthreads = 1;      /* Threads to list them on */
+enum outstyle {OUT_READABLE, OUT_ZMAKEBAS, OUT_ZXTEXT2P, OUT_NDJSON};
 enum outstyle style = OUT_READABLE;
-int inFirstLineREM; /* 1=First line is a REM and we are on the first line */
 int onlyFirstLineREM = 0; /* 1=Only preserve codes in a first line REM, 0=Preserve codes everywhere */
+int bench = 0; /* >0 = time this many listings of the generic and specialized loops */
+int checkNumbers = 0; /* 1=Report numbers whose text and value differ instead of listing */
+long mismatches = 0; /* Numbers that differ in all the files */
+int diffMode = 0; /* 1=List the differences between two files */
+unsigned lineFrom = 0, lineTo = 65535; /* Range of lines to list with -L */
 
 /* Character mapping ZX81 character set to ASCII
  *
@@ -234,42 +254,92 @@ char *charset_zxtext2p[] =
 
 char **charset = charset_read;
 
-/* get a single ZX81 program line & line number & length */
+/* The charset strings with their lengths and escapes worked out once, so the
+ * per character work is just a memcpy into the output buffer.
+ */
 
-void zxgetline(FILE *in, int *linenum, int *linelen, int *t)
-{
-int b1, b2, f;
+#define XC_ESCZ 1 /* Zmakebas: give as a \{n} code in REMs and quotes */
+#define XC_ESCH 2 /* ZXText2P: give as a \XX hex code in a first line REM */
+
+typedef struct
+    {
+    const char *s;      /* Translated text */
+    int len;
+    int flags;
+    char escz[8];       /* "\{n}" */
+    int esczlen;
+    char esch[4];       /* "\XX" */
+    } XCHAR;
 
-b1 = fgetc(in);
-b2 = fgetc(in);
-*linenum = b1 * 256 + b2;
-(*t) -= 2;
+XCHAR xchars[256];
 
-b1 = fgetc(in);
-b2 = fgetc(in);
-*linelen = b1 + 256 * b2;
-(*t) -= 2;
+/* make a copy of s with its quotes and backslashes escaped for JSON.
+ * Returns the length of the copy, which is left in *js.
+ */
 
-for (f = 0; f < *linelen; f++)
-  {
-  linebuf[f] = fgetc(in);
-  (*t)--;
-  }
+int jsonescape (const char **js, const char *s)
+{
+char *e;
+int n = 0;
+
+e = malloc(2 * strlen(s) + 1);
+if (e == NULL)
+    {
+    fprintf(stderr, "Error: out of memory\n");
+    exit(1);
+    }
+for (; *s; s++)
+    {
+    if (*s == '"' || *s == '\\')
+        e[n++] = '\\';
+    e[n++] = *s;
+    }
+e[n] = '\0';
+*js = e;
+return n;
 }
 
+void buildxchars (char **cs)
+{
+int c;
+XCHAR *xc;
 
-/* translate line into keywords using the charset array */
+for (c = 0; c < 256; c++)
+    {
+    xc = &xchars[c];
+    xc->s = cs[c];
+    xc->len = strlen(cs[c]);
+    if (style == OUT_NDJSON && strpbrk(cs[c], "\"\\"))
+        xc->len = jsonescape(&xc->s, cs[c]);
+    xc->flags = 0;
+    if ( strcmp(cs[c], NAK) == 0 || (xc->len > 1 && cs[c][0] != '\\' && cs[c][0] != '`') )
+        xc->flags |= XC_ESCZ;
+    if ( (c > 63 && c < 128) || c > 191 )
+        xc->flags |= XC_ESCH;
+    xc->esczlen = sprintf(xc->escz, "\\{%d}", c);
+    sprintf(xc->esch, "\\%02X", c);
+    }
+}
+
+/* translate line into keywords using the charset array
+ *
+ * This is the generic version that checks the style for every character. The
+ * listing uses the specialized versions below, and this is kept as the
+ * reference for them with the --bench option.
+ */
 
-void xlatline(int linelen)
+void xlatline(OUTBUF *ob, const unsigned char *text, int linelen, int inFirstLineREM)
 {
 int f, inQuotes = 0;
-unsigned char c, keyword = linebuf[0];
-char *x;
+unsigned char c, keyword = linelen > 0 ? text[0] : 0;
+const XCHAR *x;
+int escz = ( style == OUT_ZMAKEBAS && (!onlyFirstLineREM || inFirstLineREM) );
+int esch = ( style == OUT_ZXTEXT2P && inFirstLineREM );
 
 for (f = 0; f < linelen - 1; f++)
     {
-    c = linebuf[f]; /* Character code  */
-    x = charset[c]; /* Translated code */
+    c = text[f];        /* Character code  */
+    x = &xchars[c];     /* Translated code */
 
     if ( (keyword != REM_code) && (c == QUOTE_code) )
         inQuotes = !inQuotes;
@@ -279,52 +349,1125 @@ for (f = 0; f < linelen - 1; f++)
 
     else if ( (keyword == REM_code && f > 0) || inQuotes)
         {
-        if ( style == OUT_ZMAKEBAS && (!onlyFirstLineREM || inFirstLineREM) &&
-                ((strcmp(x, NAK) == 0) || ((strlen(x) > 1) && (x[0] != '\\') && (x[0]!='`'))) )
+        if ( escz && (x->flags & XC_ESCZ) )
+
+            obWrite(ob, x->escz, x->esczlen); /* Escaped as char code */
+
+        else if ( esch && (x->flags & XC_ESCH) )
+
+            obWrite(ob, x->esch, 3); /* Backslash-escaped hex code */
+
+        else
+            obWrite(ob, x->s, x->len); /* Translated char */
+        }
+    else
+        obWrite(ob, x->s, x->len); /* Translated char */
+    }
+obPutc(ob, '\n');
+}
+
+
+/* The specialized translators made from the xlatline.h template */
+
+typedef void (*XLATFN)(OUTBUF *ob, const unsigned char *text, int linelen,
+                       int inFirstLineREM);
+
+#define XLAT_NAME xlatplain
+#define XLAT_ESC 0
+#include "xlatline.h"
+
+#define XLAT_NAME xlatzmb
+#define XLAT_ESC XC_ESCZ
+#include "xlatline.h"
+
+#define XLAT_NAME xlathex
+#define XLAT_ESC XC_ESCH
+#include "xlatline.h"
+
+
+/* NDJSON output, one object per line:
+ *
+ *   {"line":10,"offset":116,"length":12,"keyword":245,"text":" PRINT ...",
+ *    "rem":"..."}
+ *
+ * offset is where the line starts in the file, length the length from the
+ * line header (text and NEWLINE), keyword the first code of the line, and text
+ * the readable translation. REM lines also have the bytes after the REM in
+ * base64 as "rem". With several files on stdout, each object starts with
+ * "file" giving the file name.
+ */
+
+void obJsonStr (OUTBUF *ob, const char *s)
+{
+char esc[8];
+
+obPutc(ob, '"');
+for (; *s; s++)
+    {
+    if (*s == '"' || *s == '\\')
+        {
+        obPutc(ob, '\\');
+        obPutc(ob, *s);
+        }
+    else if ((unsigned char)*s < 32)
+        {
+        sprintf(esc, "\\u%04x", (unsigned char)*s);
+        obPuts(ob, esc);
+        }
+    else
+        obPutc(ob, *s);
+    }
+obPutc(ob, '"');
+}
+
+void obBase64 (OUTBUF *ob, const unsigned char *b, int n)
+{
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+char q[4];
+unsigned long v;
+
+for (; n >= 3; n -= 3, b += 3)
+    {
+    v = ((unsigned long)b[0] << 16) | (b[1] << 8) | b[2];
+    q[0] = b64[v >> 18];
+    q[1] = b64[(v >> 12) & 63];
+    q[2] = b64[(v >> 6) & 63];
+    q[3] = b64[v & 63];
+    obWrite(ob, q, 4);
+    }
+if (n > 0)
+    {
+    v = ((unsigned long)b[0] << 16) | (n > 1 ? b[1] << 8 : 0);
+    q[0] = b64[v >> 18];
+    q[1] = b64[(v >> 12) & 63];
+    q[2] = n > 1 ? b64[(v >> 6) & 63] : '=';
+    q[3] = '=';
+    obWrite(ob, q, 4);
+    }
+}
+
+void xlatjson (OUTBUF *ob, const PLINE *line, const char *name)
+{
+int f;
+unsigned char c;
+const XCHAR *x;
+const unsigned char *text = line->text;
+int linelen = line->len;
+
+obPutc(ob, '{');
+if (name)
+    {
+    obPuts(ob, "\"file\":");
+    obJsonStr(ob, name);
+    obPutc(ob, ',');
+    }
+obPuts(ob, "\"line\":");
+obNum(ob, line->num, 0);
+obPuts(ob, ",\"offset\":");
+obNum(ob, line->offset, 0);
+obPuts(ob, ",\"length\":");
+obNum(ob, line->len, 0);
+obPuts(ob, ",\"keyword\":");
+obNum(ob, linelen > 0 ? text[0] : 0, 0);
+obPuts(ob, ",\"text\":\"");
+for (f = 0; f < linelen - 1; f++)
+    {
+    c = text[f];
+    x = &xchars[c];
+    if (c == NUM_code && text[0] != REM_code)
+        {
+        f += 5; /* avoid inline FP numbers */
+        continue;
+        }
+    obWrite(ob, x->s, x->len);
+    }
+obPutc(ob, '"');
+if (linelen > 1 && text[0] == REM_code)
+    {
+    obPuts(ob, ",\"rem\":\"");
+    obBase64(ob, text + 1, linelen - 2);
+    obPutc(ob, '"');
+    }
+obPuts(ob, "}\n");
+}
+
+
+/* get the next program line in the -L range.
+ * Returns 0 at the end of the program. Lines outside the range are skipped
+ * by their headers alone; the rest of the program is still looked at past
+ * lineTo, as a program that was POKEd can have its lines out of order.
+ */
+
+int nextInRange (PITER *it, PLINE *line)
+{
+while (pfileNext(it, line))
+    {
+    if (line->num >= lineFrom && line->num <= lineTo)
+        return 1;
+    }
+return 0;
+}
+
+/* the translator for the output style, and for a first line that is a REM */
+
+XLATFN pickxlat (int inFirstLineREM)
+{
+if (inFirstLineREM && style == OUT_ZMAKEBAS)
+    return xlatzmb;
+if (inFirstLineREM && style == OUT_ZXTEXT2P)
+    return xlathex;
+return (style == OUT_ZMAKEBAS && !onlyFirstLineREM) ? xlatzmb : xlatplain;
+}
+
+/* process the lines of a loaded .P file from offset start up to end to the
+ * output buffer
+ */
+
+void thrashpart (OUTBUF *ob, const PFILE *pf, long start, long end,
+                 const char *name, int generic)
+{
+PFILE part = *pf; /* The same image, with the program ending where the part does */
+PITER it;
+PLINE line;
+XLATFN first, rest;
+int inFirstLineREM;
+
+/* run through the program lines up to the end of the part */
+part.prog_end = end;
+pfileStart(&it, &part);
+it.next = start;
+if (style == OUT_NDJSON)
+    {
+    while (nextInRange(&it, &line))
+        xlatjson(ob, &line, name);
+    return;
+    }
+if (!pfileNext(&it, &line))
+    return;
+inFirstLineREM = (line.offset == PF_PROGRAM - PF_SYSSAVE
+                  && line.len > 0 && line.text[0] == REM_code);
+
+/* Pick the translators for the first line and the rest once */
+if (generic)
+    first = rest = xlatline;
+else
+    {
+    first = pickxlat(inFirstLineREM);
+    rest = pickxlat(0);
+    }
+
+if (line.num >= lineFrom && line.num <= lineTo)
+    {
+    obNum(ob, line.num, 4);
+    first(ob, line.text, line.len, inFirstLineREM);
+    }
+
+while (nextInRange(&it, &line))
+    {
+    obNum(ob, line.num, 4);
+    rest(ob, line.text, line.len, 0);
+    }
+}
+
+
+/* report the numbers whose visible text doesn't match their hidden value
+ *
+ * Some programs have a different value in the 5 bytes after the number than
+ * the text shows, to save memory (the text is often just "0" or ".") or to
+ * hide what the program does. Returns how many were found.
+ */
+
+#define NUM_TOLERANCE 1e-8 /* Relative difference allowed for rounding by the ROM */
+
+int checkfile (OUTBUF *ob, const PFILE *pf, const char *name)
+{
+PITER it;
+PLINE line;
+int f, found = 0;
+double text, value;
+char num[40];
+
+pfileStart(&it, pf);
+while (nextInRange(&it, &line))
+    {
+    if (line.len > 0 && line.text[0] == REM_code)
+        continue;
+    for (f = 0; f + 5 < (int)line.len; f++)
+        {
+        if (line.text[f] != NUM_code)
+            continue;
+        value = pfileNumber(line.text + f + 1);
+        if ( pfileNumText(line.text, f, num, sizeof(num)) < 0 )
+            strcpy(num, "");
+        text = strtod(num, NULL);
+        if ( num[0] == '\0'
+             || fabs(text - value) > NUM_TOLERANCE * fmax(fabs(text), fabs(value)) )
+            {
+            obPuts(ob, name);
+            obPutc(ob, ':');
+            obNum(ob, line.num, 0);
+            obPuts(ob, ": \"");
+            obPuts(ob, num);
+            sprintf(num, "\" is %.10g\n", value);
+            obPuts(ob, num);
+            found++;
+            }
+        f += 5;
+        }
+    }
+return found;
+}
 
-            printf("\\{%d}", c); /* Print escaped as char code */
 
-        else if ( style == OUT_ZXTEXT2P && inFirstLineREM && ((c>63 && c<128) || c>191) )
+/* process loaded .P file to the output buffer */
 
-            printf("\\%02X", c); /* Print as backslash-escaped hex code */
+void thrashfile (OUTBUF *ob, const PFILE *pf, const char *name, int generic)
+{
+thrashpart(ob, pf, PF_PROGRAM - PF_SYSSAVE, pf->prog_end, name, generic);
+}
+
+#ifdef P2T_THREADS
+
+/* Splitting one large program across the threads
+ *
+ * One pass over the line headers finds where to cut the program into about
+ * equal parts. The lines don't depend on each other once we know where they
+ * start, so each part is translated on its own thread into its own buffer,
+ * and the buffers are written out in order.
+ */
+
+#define SPLIT_MIN 4096 /* Fewest bytes of program worth a thread */
+
+typedef struct
+    {
+    const PFILE *pf;
+    long start, end;    /* Offsets of its first line and just past its last */
+    const char *name;
+    OUTBUF ob;
+    } PART;
+
+void *thrashthread (void *arg)
+{
+PART *part = arg;
+
+thrashpart(&part->ob, part->pf, part->start, part->end, part->name, 0);
+return NULL;
+}
+
+/* process a loaded .P file on up to nthreads threads.
+ * Returns 0 if done, or -1 if it's too small to split or the threads couldn't
+ * be started, and nothing has been written.
+ */
+
+int thrashsplit (OUTBUF *ob, const PFILE *pf, const char *name)
+{
+PART parts[MAX_THREADS];
+pthread_t tids[MAX_THREADS];
+PITER it;
+PLINE line;
+long start = PF_PROGRAM - PF_SYSSAVE, size = pf->prog_end - start;
+int nparts, i, k, started;
+
+nparts = size / SPLIT_MIN;
+if (nparts > nthreads)
+    nparts = nthreads;
+if (nparts < 2)
+    return -1;
+
+/* Cut at the first line at or after each nparts'th of the program */
+parts[0].start = start;
+k = 1;
+pfileStart(&it, pf);
+while (k < nparts && pfileNext(&it, &line))
+    if (line.offset >= start + k * size / nparts)
+        parts[k++].start = line.offset;
+nparts = k;
+
+for (i = 0; i < nparts; i++)
+    {
+    parts[i].pf = pf;
+    parts[i].end = (i + 1 < nparts) ? parts[i + 1].start : pf->prog_end;
+    parts[i].name = name;
+    if ( obInit(&parts[i].ob, NULL, OB_SIZE) != 0 )
+        break;
+    }
+if (i < nparts)
+    {
+    while (i-- > 0)
+        obFree(&parts[i].ob);
+    return -1;
+    }
+
+/* This thread does the first part */
+for (started = 1; started < nparts; started++)
+    if ( pthread_create(&tids[started], NULL, thrashthread, &parts[started]) != 0 )
+        break;
+if (started < nparts)
+    {
+    for (i = 1; i < started; i++)
+        pthread_join(tids[i], NULL);
+    for (i = 0; i < nparts; i++)
+        obFree(&parts[i].ob);
+    return -1;
+    }
+thrashthread(&parts[0]);
+for (i = 1; i < nparts; i++)
+    pthread_join(tids[i], NULL);
+
+for (i = 0; i < nparts; i++)
+    {
+    obWrite(ob, parts[i].ob.buf, parts[i].ob.len);
+    if (parts[i].ob.error)
+        ob->error = 1;
+    obFree(&parts[i].ob);
+    }
+return 0;
+}
+
+#endif
+
+
+/* Comparing two programs with --diff
+ *
+ * Each line of both programs is hashed, and the lines are paired up by line
+ * number. A line in both with different bytes is changed. Of the lines only
+ * in one or the other, the longest common subsequence of the same bytes is
+ * taken as lines that were renumbered, and the rest as removed or added.
+ */
 
+#define DIFF_LCS_MAX (1L << 22) /* Most cells in the LCS table before matching greedily */
+
+typedef struct
+    {
+    PLINE line;
+    unsigned long hash;
+    int first;          /* 1=First line of the program */
+    int match;          /* Index of this line renumbered in the other program, or -1 */
+    } DLINE;
+
+unsigned long linehash (const PLINE *line)
+{
+/* FNV-1a */
+unsigned long h = 2166136261UL;
+unsigned int i;
+
+for (i = 0; i < line->len; i++)
+    h = ((h ^ line->text[i]) * 16777619UL) & 0xFFFFFFFFUL;
+return h;
+}
+
+int sameline (const DLINE *a, const DLINE *b)
+{
+return a->hash == b->hash && a->line.len == b->line.len
+       && memcmp(a->line.text, b->line.text, a->line.len) == 0;
+}
+
+/* order lines by number, then by where they are in the file */
+
+int cmpdline (const void *p, const void *q)
+{
+const DLINE *a = p, *b = q;
+
+if (a->line.num != b->line.num)
+    return a->line.num < b->line.num ? -1 : 1;
+return a->line.offset < b->line.offset ? -1 : a->line.offset > b->line.offset;
+}
+
+/* the lines of a program in the -L range, sorted by line number for
+ * pairing them up, as the lines of a program can be out of order.
+ * Returns how many, or -1.
+ */
+
+int difflines (const PFILE *pf, DLINE **lines)
+{
+PITER it;
+PLINE line;
+DLINE *d = NULL, *nd;
+int n = 0, max = 0;
+long first;
+
+pfileStart(&it, pf);
+first = it.next;
+while (nextInRange(&it, &line))
+    {
+    if (n >= max)
+        {
+        max = max ? 2 * max : 256;
+        nd = realloc(d, max * sizeof(DLINE));
+        if (nd == NULL)
+            {
+            free(d);
+            return -1;
+            }
+        d = nd;
+        }
+    d[n].line = line;
+    d[n].hash = linehash(&line);
+    d[n].first = (line.offset == first);
+    d[n].match = -1;
+    n++;
+    }
+if (n > 1)
+    qsort(d, n, sizeof(DLINE), cmpdline);
+*lines = d;
+return n;
+}
+
+/* pair up the removed lines ra[] of a with the added lines rb[] of b that
+ * are the same, keeping them in order
+ */
+
+void matchrenumbered (DLINE *a, const int *ra, int nra, DLINE *b, const int *rb, int nrb)
+{
+int i, j, k;
+int *lcs;
+long w = nrb + 1;
+
+if ((long)(nra + 1) * w > DIFF_LCS_MAX
+    || (lcs = malloc((nra + 1) * w * sizeof(int))) == NULL)
+    {
+    /* Too big for the table, so take the next same line in order */
+    for (i = 0, k = 0; i < nra && k < nrb; i++)
+        for (j = k; j < nrb; j++)
+            if (sameline(&a[ra[i]], &b[rb[j]]))
+                {
+                a[ra[i]].match = rb[j];
+                b[rb[j]].match = ra[i];
+                k = j + 1;
+                break;
+                }
+    return;
+    }
+
+for (i = nra; i >= 0; i--)
+    for (j = nrb; j >= 0; j--)
+        {
+        if (i == nra || j == nrb)
+            lcs[i * w + j] = 0;
+        else if (sameline(&a[ra[i]], &b[rb[j]]))
+            lcs[i * w + j] = 1 + lcs[(i + 1) * w + j + 1];
+        else if (lcs[(i + 1) * w + j] >= lcs[i * w + j + 1])
+            lcs[i * w + j] = lcs[(i + 1) * w + j];
         else
-            printf("%s", x); /* Print translated char */
+            lcs[i * w + j] = lcs[i * w + j + 1];
+        }
+for (i = 0, j = 0; i < nra && j < nrb; )
+    {
+    if (sameline(&a[ra[i]], &b[rb[j]]))
+        {
+        a[ra[i]].match = rb[j];
+        b[rb[j]].match = ra[i];
+        i++;
+        j++;
+        }
+    else if (lcs[(i + 1) * w + j] >= lcs[i * w + j + 1])
+        i++;
+    else
+        j++;
+    }
+free(lcs);
+}
+
+void diffline (OUTBUF *ob, char mark, const DLINE *d)
+{
+obPutc(ob, mark);
+obPutc(ob, ' ');
+obNum(ob, d->line.num, 4);
+pickxlat(d->first && d->line.len > 0 && d->line.text[0] == REM_code)
+    (ob, d->line.text, d->line.len, d->first);
+}
+
+/* list the differences between two programs.
+ * Returns 0 if they are the same, 1 if they differ, or 2 for trouble.
+ */
+
+int difffiles (const char *namea, const char *nameb)
+{
+PFILE pfa, pfb;
+DLINE *a = NULL, *b = NULL;
+int na, nb, i, j, nra = 0, nrb = 0, changes = 0;
+int *ra = NULL, *rb = NULL;
+OUTBUF ob;
+
+if ( pfileOpen(&pfa, namea) != 0 )
+    {
+    fprintf(stderr, "Error: couldn't open file '%s'\n", namea);
+    return 2;
+    }
+if ( pfileOpen(&pfb, nameb) != 0 )
+    {
+    fprintf(stderr, "Error: couldn't open file '%s'\n", nameb);
+    pfileClose(&pfa);
+    return 2;
+    }
+na = difflines(&pfa, &a);
+nb = difflines(&pfb, &b);
+if (na >= 0 && nb >= 0)
+    {
+    ra = malloc((na + 1) * sizeof(int));
+    rb = malloc((nb + 1) * sizeof(int));
+    }
+if (ra == NULL || rb == NULL || obInit(&ob, stdout, OB_SIZE) != 0)
+    {
+    fprintf(stderr, "Error: out of memory\n");
+    free(ra);
+    free(rb);
+    free(a);
+    free(b);
+    pfileClose(&pfa);
+    pfileClose(&pfb);
+    return 2;
+    }
+
+/* Pair the lines up by number, and find the ones only in one program */
+for (i = 0, j = 0; i < na || j < nb; )
+    {
+    if (i < na && j < nb && a[i].line.num == b[j].line.num)
+        i++, j++;
+    else if (j >= nb || (i < na && a[i].line.num < b[j].line.num))
+        ra[nra++] = i++;
+    else
+        rb[nrb++] = j++;
+    }
+matchrenumbered(a, ra, nra, b, rb, nrb);
+
+/* Then list what's different in line number order */
+for (i = 0, j = 0; i < na || j < nb; )
+    {
+    if (i < na && j < nb && a[i].line.num == b[j].line.num)
+        {
+        if (!sameline(&a[i], &b[j]))
+            {
+            diffline(&ob, '-', &a[i]);
+            diffline(&ob, '+', &b[j]);
+            changes++;
+            }
+        i++, j++;
+        }
+    else if (j >= nb || (i < na && a[i].line.num < b[j].line.num))
+        {
+        if (a[i].match < 0)
+            {
+            diffline(&ob, '-', &a[i]);
+            changes++;
+            }
+        i++;
         }
     else
-        printf("%s", x); /* Print translated char */
+        {
+        if (b[j].match >= 0)
+            {
+            /* Renumbered, so give the old number then the line */
+            obPuts(&ob, "~ ");
+            obNum(&ob, a[b[j].match].line.num, 4);
+            obPuts(&ob, " ->");
+            diffline(&ob, ' ', &b[j]);
+            }
+        else
+            diffline(&ob, '+', &b[j]);
+        changes++;
+        j++;
+        }
+    }
+
+obFlush(&ob);
+i = ob.error;
+obFree(&ob);
+free(ra);
+free(rb);
+free(a);
+free(b);
+pfileClose(&pfa);
+pfileClose(&pfb);
+if (i)
+    {
+    fprintf(stderr, "Error: couldn't write to stdout\n");
+    return 2;
+    }
+return changes ? 1 : 0;
+}
+
+
+/* time the generic and specialized translations of a file */
+
+void benchfile (const char *name, const PFILE *pf, int n)
+{
+int i, same;
+clock_t t0, t1, t2;
+char *generic;
+size_t glen;
+OUTBUF ob;
+
+if ( obInit(&ob, NULL, OB_SIZE) != 0 ) /* Keep the listings in memory */
+    {
+    fprintf(stderr, "Error: out of memory\n");
+    exit(1);
+    }
+
+t0 = clock();
+for (i = 0; i < n; i++)
+    {
+    ob.len = 0;
+    thrashfile(&ob, pf, NULL, 1);
+    }
+t1 = clock();
+glen = ob.len;
+generic = malloc(glen + 1);
+if (generic)
+    memcpy(generic, ob.buf, glen);
+for (i = 0; i < n; i++)
+    {
+    ob.len = 0;
+    thrashfile(&ob, pf, NULL, 0);
+    }
+t2 = clock();
+same = generic && ob.len == glen && memcmp(generic, ob.buf, glen) == 0;
+free(generic);
+obFree(&ob);
+
+fprintf(stderr, "%s: %d listings of %lu bytes\n", name, n, (unsigned long)glen);
+fprintf(stderr, "  generic:     %8.2f ms, %8.1f us/listing\n",
+        1000.0 * (t1 - t0) / CLOCKS_PER_SEC, 1e6 * (t1 - t0) / CLOCKS_PER_SEC / n);
+fprintf(stderr, "  specialized: %8.2f ms, %8.1f us/listing\n",
+        1000.0 * (t2 - t1) / CLOCKS_PER_SEC, 1e6 * (t2 - t1) / CLOCKS_PER_SEC / n);
+if (t2 > t1)
+    fprintf(stderr, "  speedup:     %8.2fx\n", (double)(t1 - t0) / (t2 - t1));
+if (!same)
+    {
+    fprintf(stderr, "Error: specialized listing differs from the generic one\n");
+    exit(1);
+    }
+}
+
+
+/* Batch listing of several files
+ *
+ * Each input file is a JOB listed into its own OUTBUF. With -d each listing
+ * goes to its own file in the output directory. Otherwise the listings are
+ * kept in memory until they can be written to stdout in the order the files
+ * were given, whatever order the threads finish them in.
+ */
+
+#define JOB_WAITING 0
+#define JOB_DONE    1
+#define JOB_FAILED  2
+
+typedef struct
+    {
+    const char *name;   /* Input file */
+    OUTBUF ob;          /* Its listing */
+    int state;
+    const char *error;  /* What went wrong if JOB_FAILED */
+    int mismatches;     /* Numbers found by --check-numbers */
+    } JOB;
+
+/* make the output file name for an input file in the -d directory */
+
+char *outputname (const char *name)
+{
+const char *base, *p, *dot = NULL;
+char *out;
+size_t baselen;
+const char *ext = (style == OUT_ZMAKEBAS) ? ".bas" :
+                  (style == OUT_NDJSON) ? ".json" : ".txt";
+
+base = name;
+for (p = name; *p; p++)
+    {
+#ifdef __MSDOS__
+    if (*p == '/' || *p == '\\' || *p == ':')
+#else
+    if (*p == '/')
+#endif
+        {
+        base = p + 1;
+        dot = NULL;
+        }
+    else if (*p == '.')
+        dot = p;
+    }
+baselen = (dot && dot > base) ? (size_t)(dot - base) : strlen(base);
+
+out = malloc(strlen(outdir) + baselen + strlen(ext) + 2);
+if (out)
+    sprintf(out, "%s/%.*s%s", outdir, (int)baselen, base, ext);
+return out;
+}
+
+/* list one file to out, or into memory if out is NULL.
+ * Returns 0 if OK, or -1 with job->error set.
+ */
+
+int listjob (JOB *job, FILE *out)
+{
+PFILE pf;
+char *outname = NULL;
+
+job->ob.buf = NULL;
+if ( pfileOpen(&pf, job->name) != 0 )
+    {
+    job->error = "couldn't open file";
+    return -1;
+    }
+if (outdir)
+    {
+    outname = outputname(job->name);
+    out = outname ? fopen(outname, "w") : NULL;
+    free(outname);
+    if (out == NULL)
+        {
+        pfileClose(&pf);
+        job->error = "couldn't create the output file for";
+        return -1;
+        }
+    }
+if ( obInit(&job->ob, out, OB_SIZE) != 0 )
+    {
+    pfileClose(&pf);
+    if (outdir)
+        fclose(out);
+    job->error = "out of memory listing";
+    return -1;
+    }
+
+if (checkNumbers)
+    job->mismatches = checkfile(&job->ob, &pf, job->name);
+else
+    {
+    if (ninfiles > 1 && !outdir && style != OUT_NDJSON)
+        {
+        /* Say where each listing starts, as a comment to zmakebas */
+        obPuts(&job->ob, "# ");
+        obPuts(&job->ob, job->name);
+        obPutc(&job->ob, '\n');
+        }
+#ifdef P2T_THREADS
+    /* One program to list, so split it up for the threads instead */
+    if ( ninfiles > 1 || nthreads < 2 || thrashsplit(&job->ob, &pf, NULL) != 0 )
+#endif
+        thrashfile(&job->ob, &pf, (ninfiles > 1 && !outdir) ? job->name : NULL, 0);
+    }
+pfileClose(&pf);
+
+if (outdir)
+    {
+    obFlush(&job->ob);
+    if (fclose(out) != 0)
+        job->ob.error = 1;
+    obFree(&job->ob);
+    }
+if (job->ob.error)
+    {
+    obFree(&job->ob);
+    job->error = "error writing the listing of";
+    return -1;
+    }
+return 0;
+}
+
+/* finish a job in input order: report it, or write its listing to stdout */
+
+int writejob (JOB *job)
+{
+if (job->state == JOB_FAILED)
+    {
+    fprintf(stderr, "Error: %s '%s'\n", job->error, job->name);
+    return -1;
+    }
+mismatches += job->mismatches;
+if (job->ob.buf)
+    {
+    if (job->ob.out == NULL)
+        job->ob.out = stdout;
+    obFlush(&job->ob);
+    obFree(&job->ob);
+    if (job->ob.error)
+        {
+        fprintf(stderr, "Error: couldn't write the listing of '%s'\n", job->name);
+        return -1;
+        }
+    }
+return 0;
+}
+
+#ifdef P2T_THREADS
+
+typedef struct
+    {
+    JOB *jobs;
+    int njobs;
+    int next;           /* Next job to hand out */
+    int written;        /* Jobs finished by the writer */
+    int window;         /* How many jobs the listers may get ahead, 0 = any */
+    pthread_mutex_t lock;
+    pthread_cond_t done;    /* A job has been listed */
+    pthread_cond_t room;    /* The writer has finished a job */
+    } POOL;
+
+void *lister (void *arg)
+{
+POOL *pool = arg;
+int i, r;
+
+for (;;)
+    {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->njobs && pool->window > 0
+           && pool->next >= pool->written + pool->window)
+        pthread_cond_wait(&pool->room, &pool->lock);
+    i = pool->next;
+    if (i < pool->njobs)
+        pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->njobs)
+        return NULL;
+
+    r = listjob(&pool->jobs[i], NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs[i].state = r ? JOB_FAILED : JOB_DONE;
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
     }
-printf("\n");
 }
 
+/* list the jobs on nthreads threads, writing them out in order as they finish.
+ * Returns the number of jobs that failed, or -1 if no threads could be started.
+ */
+
+int runthreads (JOB *jobs, int njobs)
+{
+POOL pool;
+pthread_t *tids;
+int i, started, failed = 0;
+
+tids = malloc(nthreads * sizeof(pthread_t));
+if (tids == NULL)
+    return -1;
+pool.jobs = jobs;
+pool.njobs = njobs;
+pool.next = 0;
+pool.written = 0;
+pool.window = outdir ? 0 : 4 * nthreads; /* Limit the listings held in memory */
+pthread_mutex_init(&pool.lock, NULL);
+pthread_cond_init(&pool.done, NULL);
+pthread_cond_init(&pool.room, NULL);
 
-/* process (opened) .P file to stdout */
+for (started = 0; started < nthreads; started++)
+    if ( pthread_create(&tids[started], NULL, lister, &pool) != 0 )
+        break;
+
+if (started > 0)
+    {
+    for (i = 0; i < njobs; i++)
+        {
+        pthread_mutex_lock(&pool.lock);
+        while (jobs[i].state == JOB_WAITING)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
 
-void thrashfile (FILE *in)
+        if ( writejob(&jobs[i]) != 0 )
+            failed++;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.written = i + 1;
+        pthread_cond_broadcast(&pool.room);
+        pthread_mutex_unlock(&pool.lock);
+        }
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    }
+
+pthread_cond_destroy(&pool.room);
+pthread_cond_destroy(&pool.done);
+pthread_mutex_destroy(&pool.lock);
+free(tids);
+return started > 0 ? failed : -1;
+}
+
+#endif
+
+/* order input file numbers by their -d output names */
+
+char **sortnames; /* Output names for cmpoutname() */
+
+int cmpoutname (const void *p, const void *q)
 {
-int b1, b2;
-int f, linelen, linenum, d_file, total;
+int a = *(const int *)p, b = *(const int *)q;
+int c = strcmp(sortnames[a], sortnames[b]);
 
-for (f = 1; f <= 3; f++)
-    fgetc(in);   /* ignore sys vars */
-b1 = fgetc(in); b2=fgetc(in);           /* except d_file */
-d_file = b1 + 256 * b2;
-for (f = 1; f <= 111; f++)
-    fgetc(in); /* ignore more sys vars */
+return c ? c : a - b;
+}
 
-total = d_file - 16509; /* if d_file is after, prog is 16509 to d_file-1 right? */
+/* check that no two input files would be listed to the same file in the
+ * -d directory, such as a/x.p and b/x.p. Returns how many clash.
+ */
 
-/* run through 'total' bytes, interpreting them as ZX81 program lines */
-zxgetline(in, &linenum, &linelen, &total);
-inFirstLineREM = (linebuf[0] == REM_code);
+int checkoutnames ()
+{
+char **names;
+int *order;
+int i, clashes = 0;
 
-while (total >= 0)
+names = malloc(ninfiles * sizeof(char *));
+order = malloc(ninfiles * sizeof(int));
+if (names == NULL || order == NULL)
     {
-    printf("%4d", linenum);
-    xlatline(linelen);
-    inFirstLineREM = 0;
-    zxgetline(in, &linenum, &linelen, &total);
+    fprintf(stderr, "Error: out of memory\n");
+    exit(1);
     }
+for (i = 0; i < ninfiles; i++)
+    {
+    names[i] = outputname(infiles[i]);
+    if (names[i] == NULL)
+        {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+        }
+    order[i] = i;
+    }
+sortnames = names;
+qsort(order, ninfiles, sizeof(int), cmpoutname);
+
+for (i = 1; i < ninfiles; i++)
+    if (strcmp(names[order[i - 1]], names[order[i]]) == 0)
+        {
+        fprintf(stderr, "Error: '%s' and '%s' would both be listed to '%s'\n",
+                infiles[order[i - 1]], infiles[order[i]], names[order[i]]);
+        clashes++;
+        }
+
+for (i = 0; i < ninfiles; i++)
+    free(names[i]);
+free(names);
+free(order);
+return clashes;
+}
+
+/* list all the input files. Returns the number that failed. */
+
+int listfiles ()
+{
+JOB *jobs;
+int i, failed = 0;
+
+if (outdir && ninfiles > 1 && checkoutnames() != 0)
+    return ninfiles;
+jobs = calloc(ninfiles, sizeof(JOB));
+if (jobs == NULL)
+    {
+    fprintf(stderr, "Error: out of memory\n");
+    exit(1);
+    }
+for (i = 0; i < ninfiles; i++)
+    {
+    jobs[i].name = infiles[i];
+    jobs[i].state = JOB_WAITING;
+    }
+
+#ifdef P2T_THREADS
+if (nthreads > 1 && ninfiles > 1)
+    {
+    failed = runthreads(jobs, ninfiles);
+    if (failed >= 0)
+        {
+        free(jobs);
+        return failed;
+        }
+    failed = 0; /* No threads, so do them here */
+    }
+#endif
+
+/* One at a time, straight to stdout */
+for (i = 0; i < ninfiles; i++)
+    {
+    jobs[i].state = listjob(&jobs[i], stdout) ? JOB_FAILED : JOB_DONE;
+    if ( writejob(&jobs[i]) != 0 )
+        failed++;
+    }
+free(jobs);
+return failed;
+}
+
+/* add the file names in a list file, one per line, to infiles */
+
+void readlist (const char *listname)
+{
+FILE *lf;
+char line[1024];
+char *name;
+size_t len;
+int max = ninfiles;
+
+if (strcmp(listname, "-") == 0)
+    lf = stdin;
+else if ( (lf = fopen(listname, "r")) == NULL )
+    {
+    fprintf(stderr, "Error: couldn't open list file '%s'\n", listname);
+    exit(1);
+    }
+
+while (fgets(line, sizeof(line), lf))
+    {
+    len = strlen(line);
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'
+                       || line[len-1] == ' ' || line[len-1] == '\t'))
+        line[--len] = '\0';
+    if (len == 0)
+        continue;
+    if (ninfiles >= max)
+        {
+        max = max ? 2 * max : 256;
+        infiles = realloc(infiles, max * sizeof(char *));
+        }
+    name = malloc(len + 1);
+    if (infiles == NULL || name == NULL)
+        {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+        }
+    memcpy(name, line, len + 1);
+    infiles[ninfiles++] = name;
+    }
+if (lf != stdin)
+    fclose(lf);
+}
+
+/* set lineFrom and lineTo from an -L range of n, a-b, a- or -b.
+ * Returns 0 if OK, -1 if it isn't a range.
+ */
+
+int parserange (const char *r)
+{
+char *end;
+long a = 0, b = 65535;
+
+if (*r != '-')
+    {
+    a = strtol(r, &end, 10);
+    if (end == r)
+        return -1;
+    r = end;
+    if (*r == '\0')
+        b = a;
+    }
+if (*r == '-')
+    {
+    r++;
+    if (*r != '\0')
+        {
+        b = strtol(r, &end, 10);
+        if (end == r)
+            return -1;
+        r = end;
+        }
+    }
+if (*r != '\0' || a < 0 || b > 65535 || a > b)
+    return -1;
+lineFrom = a;
+lineTo = b;
+return 0;
 }
 
 void printUsage ()
@@ -332,18 +1475,32 @@ void printUsage ()
   printf("p2txt %s by Ryan Gray, from original by Russell Marks \n", VERSION);
   printf("    for improbabledesigns.\n");
   printf("Lists ZX81 .P files to stdout.\n");
-  printf("Usage:  p2txt [options] infile.p > outfile.txt\n");
+  printf("Usage:  p2txt [options] infile.p [infile.p ...] > outfile.txt\n");
   printf("Options are:\n");
   printf("  -z  Output Zmakebas compatible markup\n");
   printf("  -r  Output a more readable markup (default).\n");
   printf("      Inverse characters in square brackets, most block graphics.\n");
   printf("  -1  Output Zmakebas markup but only use codes in a first line that is a REM.\n");
   printf("  -2  Output ZXText2P compatible markup\n");
+  printf("  -j  Output a JSON object per line (NDJSON) with the readable text.\n");
+  printf("  -L range     Only list the lines in range: n, a-b, a- or -b.\n");
+  printf("  -f listfile  List the files named in listfile, one per line (- for stdin).\n");
+  printf("  -d outdir    Write each listing to outdir/name.bas (-z, -1), name.json (-j)\n");
+  printf("               or name.txt.\n");
+  printf("  -t n         List the files on n threads, or split one large program\n");
+  printf("               between them.\n");
   printf("  -?  Print this help.\n");
+  printf("  --bench n  Time n listings with the generic and per-style decode loops.\n");
+  printf("  --diff a.p b.p  List the lines removed (-), added (+), changed (- then +)\n");
+  printf("      or renumbered (~ old ->) from a.p to b.p. Exits with 1 if any.\n");
+  printf("  --check-numbers  Instead of listing, report each number whose text differs\n");
+  printf("      from its hidden value as file:line: \"text\" is value. Exits with 1 if any.\n");
   printf("The Zmakebas output will use \\{xxx} codes in REMs and quotes to preserve\n");
   printf("the non-printable and token character codes, whereas in readable mode, these\n");
   printf("will give a hash (#) character. Zmakebas mode also inserts inverse and true\n");
   printf("video codes where inverse characters appear in REMs and strings.\n");
+  printf("With several files and no -d, the listings go to stdout in the order given,\n");
+  printf("each after a line with # and the file name.\n");
   }
 
 void parse_options(int argc, char *argv[])
@@ -372,9 +1529,69 @@ void parse_options(int argc, char *argv[])
                 charset = charset_zxtext2p;
                 onlyFirstLineREM = 0;
                 break;
+            case 'j':
+                style = OUT_NDJSON;
+                charset = charset_read;
+                onlyFirstLineREM = 0;
+                break;
+            case 'L':
+                if (argc < 3 || parserange(argv[2]) != 0)
+                    {
+                    printUsage();
+                    fprintf(stderr, "bad line range for option: L\n");
+                    exit(EXIT_FAILURE);
+                    }
+                ++argv;
+                --argc;
+                break;
+            case 'f':
+            case 'd':
+            case 't':
+                if (argc < 3)
+                    {
+                    printUsage();
+                    fprintf(stderr, "missing argument for option: %c\n", argv[1][1]);
+                    exit(EXIT_FAILURE);
+                    }
+                if (argv[1][1] == 'f')
+                    listfile = argv[2];
+                else if (argv[1][1] == 'd')
+                    outdir = argv[2];
+                else
+                    {
+                    nthreads = atoi(argv[2]);
+                    if (nthreads < 1)
+                        nthreads = 1;
+                    if (nthreads > MAX_THREADS)
+                        nthreads = MAX_THREADS;
+                    }
+                ++argv;
+                --argc;
+                break;
             case '?':
                 printUsage();
                 exit(EXIT_SUCCESS);
+            case '-':
+                if (strcmp(argv[1], "--diff") == 0)
+                    {
+                    diffMode = 1;
+                    break;
+                    }
+                if (strcmp(argv[1], "--check-numbers") == 0)
+                    {
+                    checkNumbers = 1;
+                    break;
+                    }
+                if (strcmp(argv[1], "--bench") == 0 && argc > 2)
+                    {
+                    bench = atoi(argv[2]);
+                    ++argv;
+                    --argc;
+                    break;
+                    }
+                printUsage();
+                fprintf(stderr, "unknown option: %s\n", argv[1]);
+                exit(EXIT_FAILURE);
             default:
                 printUsage();
                 fprintf(stderr, "unknown option: %c\n", argv[1][1]);
@@ -383,29 +1600,68 @@ void parse_options(int argc, char *argv[])
 	    ++argv;
 	    --argc;
         }
-    if (argc <= 1)
+    if (argc <= 1 && listfile == NULL)
         {
         printUsage();
         exit(EXIT_FAILURE);
         }
-    infile = argv[argc-1];
+    infiles = NULL;
+    ninfiles = 0;
+    if (argc > 1)
+        {
+        infiles = malloc((argc - 1) * sizeof(char *));
+        if (infiles == NULL)
+            {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+            }
+        for (ninfiles = 0; ninfiles < argc - 1; ninfiles++)
+            infiles[ninfiles] = argv[ninfiles + 1];
+        }
+    if (listfile)
+        readlist(listfile);
 }
 
 
 int main(int argc, char *argv[])
 {
-FILE *in;
+PFILE pf;
+int i, failed;
 
 parse_options(argc, argv);
+buildxchars(charset);
 
-if ( (in = fopen(infile, "rb")) == NULL )
+if (bench > 0)
     {
-    fprintf(stderr, "Error: couldn't open file '%s'\n", infile);
-    exit(1);
+    for (i = 0; i < ninfiles; i++)
+        {
+        if ( pfileOpen(&pf, infiles[i]) != 0 )
+            {
+            fprintf(stderr, "Error: couldn't open file '%s'\n", infiles[i]);
+            exit(1);
+            }
+        benchfile(infiles[i], &pf, bench);
+        pfileClose(&pf);
+        }
+    exit(0);
     }
 
-thrashfile(in);      /* process it */
-fclose(in);
+if (diffMode)
+    {
+    if (ninfiles != 2 || style == OUT_NDJSON)
+        {
+        fprintf(stderr, "Error: --diff needs two files and a listing style\n");
+        exit(2);
+        }
+    exit(difffiles(infiles[0], infiles[1]));
+    }
+
+failed = listfiles();
+if (fflush(stdout) != 0 || ferror(stdout))
+    {
+    fprintf(stderr, "Error: couldn't write to stdout\n");
+    failed++;
+    }
 
-exit(0);
+exit((failed || mismatches) ? 1 : 0);
 }
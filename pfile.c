@@ -0,0 +1,334 @@
+/* pfile - shared access to the BASIC program in a ZX81 .P file
+ * By Ryan Gray
+ *
+ * See pfile.h for the layout. The program tools used to pull every byte of a
+ * line through fgetc() into their own line buffers, and p2ts1510 had its own
+ * walk over the lines. They all use the iterator here now.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pfile.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PF_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define PF_CHUNK 16384 /* Read size when we can't map the file */
+
+static void pfileSetEnd (PFILE *pf)
+{
+    /* Work out where the program ends from D_FILE */
+
+    long d_file;
+
+    if (pf->size < PF_D_FILE - PF_SYSSAVE + 2)
+        {
+        pf->prog_end = 0;
+        return;
+        }
+    d_file = pf->data[PF_D_FILE - PF_SYSSAVE] + 256 * pf->data[PF_D_FILE - PF_SYSSAVE + 1];
+    pf->prog_end = d_file - PF_SYSSAVE;
+    if (pf->prog_end > pf->size)
+        pf->prog_end = pf->size; /* Truncated file, only use what we have */
+}
+
+void pfileBuffer (PFILE *pf, unsigned char *data, long size)
+{
+    /* Use an image the caller has already loaded */
+
+    pf->data = data;
+    pf->size = size;
+    pf->owned = 0;
+    pfileSetEnd(pf);
+}
+
+int pfileRead (PFILE *pf, FILE *in)
+{
+    /* Read the whole of an opened file (or stdin) into memory.
+     * Returns 0 if OK, -1 if out of memory or a read error.
+     */
+
+    unsigned char *buf = NULL, *nbuf;
+    long size = 0, alloc = 0;
+    size_t n;
+
+    do  {
+        if (size + PF_CHUNK > alloc)
+            {
+            alloc = alloc ? 2 * alloc : 4 * PF_CHUNK;
+            nbuf = realloc(buf, alloc);
+            if (nbuf == NULL)
+                {
+                free(buf);
+                return -1;
+                }
+            buf = nbuf;
+            }
+        n = fread(buf + size, 1, PF_CHUNK, in);
+        size += n;
+        }
+    while (n == PF_CHUNK);
+
+    if (ferror(in))
+        {
+        free(buf);
+        return -1;
+        }
+    pf->data = buf;
+    pf->size = size;
+    pf->owned = 1;
+    pfileSetEnd(pf);
+    return 0;
+}
+
+int pfileOpen (PFILE *pf, const char *name)
+{
+    /* Load a named P file, mapping it if we can.
+     * Returns 0 if OK, -1 if the file couldn't be opened or read.
+     */
+
+    FILE *in;
+    int rc;
+#ifdef PF_MMAP
+    int fd;
+    struct stat st;
+    void *map;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+        /* Private and writable so callers can patch the image in place */
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+            {
+            close(fd);
+            pf->data = map;
+            pf->size = st.st_size;
+            pf->owned = 2;
+            pfileSetEnd(pf);
+            return 0;
+            }
+        }
+    close(fd);
+#endif
+
+    in = fopen(name, "rb");
+    if (in == NULL)
+        return -1;
+    rc = pfileRead(pf, in);
+    fclose(in);
+    return rc;
+}
+
+void pfileClose (PFILE *pf)
+{
+#ifdef PF_MMAP
+    if (pf->owned == 2)
+        munmap(pf->data, pf->size);
+#endif
+    if (pf->owned == 1)
+        free(pf->data);
+    pf->data = NULL;
+    pf->size = 0;
+    pf->prog_end = 0;
+    pf->owned = 0;
+}
+
+void pfileStart (PITER *it, const PFILE *pf)
+{
+    it->pf = pf;
+    it->next = PF_PROGRAM - PF_SYSSAVE;
+}
+
+int pfileNext (PITER *it, PLINE *line)
+{
+    /* Get a view of the next program line.
+     * Returns 1 for a line, 0 at the end of the program. A line whose text
+     * would run past D_FILE is treated as the end.
+     */
+
+    const unsigned char *h;
+    long at = it->next;
+
+    if (at + 4 > it->pf->prog_end)
+        return 0;
+    h = it->pf->data + at;
+    line->num = 256 * h[0] + h[1];
+    line->len = h[2] + 256 * h[3];
+    if (at + 4 + (long)line->len > it->pf->prog_end)
+        return 0;
+    line->offset = at;
+    line->text = it->pf->data + at + 4;
+    it->next = at + 4 + line->len;
+    return 1;
+}
+
+int pfileLineAt (const PFILE *pf, long offset, PLINE *line)
+{
+    /* Get a view of a line at any offset in the image, even outside the
+     * program (as some autorun addresses are). The length is clipped to the
+     * end of the image. Returns 1 if OK, 0 if the header is outside the image.
+     */
+
+    const unsigned char *h;
+
+    if (offset < 0 || offset + 4 > pf->size)
+        return 0;
+    h = pf->data + offset;
+    line->num = 256 * h[0] + h[1];
+    line->len = h[2] + 256 * h[3];
+    if (offset + 4 + (long)line->len > pf->size)
+        line->len = pf->size - offset - 4;
+    line->offset = offset;
+    line->text = pf->data + offset + 4;
+    return 1;
+}
+
+long pfileIndex (const PFILE *pf, PLINE **lines)
+{
+    /* Walk the line headers once into a table of all the program lines, for
+     * tools that make more than one pass over the program. The table is
+     * malloc'd and left in *lines for the caller to free.
+     * Returns the number of lines, or -1 if out of memory.
+     */
+
+    PITER it;
+    PLINE line, *tab = NULL, *ntab;
+    long n = 0, max = 0;
+
+    pfileStart(&it, pf);
+    while (pfileNext(&it, &line))
+        {
+        if (n >= max)
+            {
+            max = max ? 2 * max : 256;
+            ntab = realloc(tab, max * sizeof(PLINE));
+            if (ntab == NULL)
+                {
+                free(tab);
+                *lines = NULL;
+                return -1;
+                }
+            tab = ntab;
+            }
+        tab[n++] = line;
+        }
+    *lines = tab;
+    return n;
+}
+
+/* Numbers
+ *
+ * A numeric literal in a line is the text of the number as typed followed by
+ * PF_NUMBER and the value in the ROM's 5 byte floating point form:
+ *
+ *   1 byte   exponent + 128, or 0 for the number 0
+ *   4 bytes  mantissa, high byte first, with the top bit (always 1 in the
+ *            value) replaced by the sign bit
+ *
+ * so the value is 0.1mmm...m (binary) * 2^(exponent - 128). The text is only
+ * for the listing, and is not checked against the value when the program runs.
+ */
+
+#define PF_CH_PLUS  21
+#define PF_CH_MINUS 22
+#define PF_CH_DOT   27
+#define PF_CH_0     28
+#define PF_CH_9     37
+#define PF_CH_E     42
+
+double pfileNumber (const unsigned char *b)
+{
+    /* The value of the 5 bytes at b */
+
+    unsigned long m;
+    double v;
+
+    if (b[0] == 0)
+        return 0.0;
+    m = ((unsigned long)(b[1] | 0x80) << 24) | ((unsigned long)b[2] << 16)
+        | ((unsigned long)b[3] << 8) | b[4];
+    v = ldexp((double)m, b[0] - 128 - 32);
+    return (b[1] & 0x80) ? -v : v;
+}
+
+static int pfileNumChar (unsigned char c)
+{
+    return (c >= PF_CH_0 && c <= PF_CH_9) || c == PF_CH_DOT || c == PF_CH_E
+           || c == PF_CH_PLUS || c == PF_CH_MINUS;
+}
+
+static int pfileNumValid (const unsigned char *s, int n)
+{
+    /* 1 if the n characters at s are all of a number: digits with an
+     * optional point, then an optional E, sign and exponent digits.
+     */
+
+    int i = 0, digits = 0;
+
+    while (i < n && s[i] >= PF_CH_0 && s[i] <= PF_CH_9)
+        i++, digits++;
+    if (i < n && s[i] == PF_CH_DOT)
+        for (i++; i < n && s[i] >= PF_CH_0 && s[i] <= PF_CH_9; i++)
+            digits++;
+    if (digits == 0)
+        return 0;
+    if (i < n && s[i] == PF_CH_E)
+        {
+        i++;
+        if (i < n && (s[i] == PF_CH_PLUS || s[i] == PF_CH_MINUS))
+            i++;
+        if (i >= n)
+            return 0;
+        while (i < n && s[i] >= PF_CH_0 && s[i] <= PF_CH_9)
+            i++;
+        }
+    return i == n;
+}
+
+int pfileNumText (const unsigned char *text, int at, char *buf, int size)
+{
+    /* Find the visible number before the PF_NUMBER at text[at], and put it
+     * in buf as ASCII. Returns the index where it starts, or -1 if there is
+     * no number there.
+     */
+
+    int start, i, n;
+    unsigned char c;
+
+    for (start = at; start > 0 && pfileNumChar(text[start - 1]); start--)
+        ;
+    /* The longest run that is a whole number, as a sign or E before it
+     * belongs to the expression rather than the number
+     */
+    for (; start < at; start++)
+        if (pfileNumValid(text + start, at - start))
+            break;
+    if (start >= at)
+        return -1;
+
+    for (i = start, n = 0; i < at && n < size - 1; i++)
+        {
+        c = text[i];
+        if (c >= PF_CH_0 && c <= PF_CH_9)
+            buf[n++] = '0' + (c - PF_CH_0);
+        else if (c == PF_CH_DOT)
+            buf[n++] = '.';
+        else if (c == PF_CH_E)
+            buf[n++] = 'E';
+        else
+            buf[n++] = (c == PF_CH_PLUS) ? '+' : '-';
+        }
+    buf[n] = '\0';
+    return start;
+}
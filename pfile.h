@@ -0,0 +1,63 @@
+/* pfile - shared access to the BASIC program in a ZX81 .P file
+ * By Ryan Gray
+ *
+ * A P file is a dump of the ZX81 RAM from VERSN (16393) up to E_LINE, so a
+ * RAM address less SYSSAVE is the offset into the file. The program runs from
+ * 16509 up to D_FILE-1 as a chain of lines, each with a 4 byte header:
+ *
+ *   2 bytes  line number, high byte first
+ *   2 bytes  length of the text that follows, low byte first
+ *   n bytes  text, ending with a NEWLINE (0x76)
+ *
+ * The whole file is held in memory (mapped where the OS allows it), and the
+ * line iterator hands out views into that image rather than copying the lines.
+ */
+
+#ifndef PFILE_H
+#define PFILE_H
+
+#include <stdio.h>
+
+#define PF_SYSSAVE  16393   /* First system variable saved in the P file */
+#define PF_D_FILE   16396   /* System variable holding the end of the program */
+#define PF_PROGRAM  16509   /* Start of the BASIC program */
+
+#define PF_NEWLINE  0x76    /* End of line character */
+#define PF_NUMBER   126     /* Marks the 5 byte number after a numeric literal */
+
+typedef struct
+    {
+    unsigned char *data;    /* The whole P file image */
+    long size;              /* Bytes in the image */
+    long prog_end;          /* Offset of D_FILE, just past the last program line */
+    int owned;              /* 0=caller's buffer, 1=malloc'd, 2=memory mapped */
+    } PFILE;
+
+typedef struct
+    {
+    unsigned int num;       /* Line number */
+    unsigned int len;       /* Length of the text, including the NEWLINE */
+    long offset;            /* Offset of the line header in the image */
+    unsigned char *text;    /* The line text in the image, not a copy */
+    } PLINE;
+
+typedef struct
+    {
+    const PFILE *pf;
+    long next;              /* Offset of the next line header */
+    } PITER;
+
+int  pfileOpen (PFILE *pf, const char *name);
+int  pfileRead (PFILE *pf, FILE *in);
+void pfileBuffer (PFILE *pf, unsigned char *data, long size);
+void pfileClose (PFILE *pf);
+
+void pfileStart (PITER *it, const PFILE *pf);
+int  pfileNext (PITER *it, PLINE *line);
+int  pfileLineAt (const PFILE *pf, long offset, PLINE *line);
+long pfileIndex (const PFILE *pf, PLINE **lines);
+
+double pfileNumber (const unsigned char *b);
+int  pfileNumText (const unsigned char *text, int at, char *buf, int size);
+
+#endif
@@ -0,0 +1,577 @@
+/* specbas - make a ZX Spectrum BASIC program in memory and write it to tape
+ * By Ryan Gray
+ *
+ * See specbas.h. The tokenizing follows zmakebas, so a .tap made here has the
+ * same program bytes as p2speccy -z text run through zmakebas.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "specbas.h"
+
+/* The 48K keywords and their tokens. A space in a keyword matches any
+ * number of spaces, including none.
+ */
+
+typedef struct
+    {
+    const char *word;
+    unsigned char token;
+    } SBKEYWORD;
+
+static const SBKEYWORD sbKeywords[] =
+{
+    {"RND", 165},       {"INKEY$", 166},    {"PI", 167},        {"FN", 168},
+    {"POINT", 169},     {"SCREEN$", 170},   {"ATTR", 171},      {"AT", 172},
+    {"TAB", 173},       {"VAL$", 174},      {"CODE", 175},      {"VAL", 176},
+    {"LEN", 177},       {"SIN", 178},       {"COS", 179},       {"TAN", 180},
+    {"ASN", 181},       {"ACS", 182},       {"ATN", 183},       {"LN", 184},
+    {"EXP", 185},       {"INT", 186},       {"SQR", 187},       {"SGN", 188},
+    {"ABS", 189},       {"PEEK", 190},      {"IN", 191},        {"USR", 192},
+    {"STR$", 193},      {"CHR$", 194},      {"NOT", 195},       {"BIN", 196},
+    {"OR", 197},        {"AND", 198},       {"<=", 199},        {">=", 200},
+    {"<>", 201},        {"LINE", 202},      {"THEN", 203},      {"TO", 204},
+    {"STEP", 205},      {"DEF FN", 206},    {"CAT", 207},       {"FORMAT", 208},
+    {"MOVE", 209},      {"ERASE", 210},     {"OPEN #", 211},    {"CLOSE #", 212},
+    {"MERGE", 213},     {"VERIFY", 214},    {"BEEP", 215},      {"CIRCLE", 216},
+    {"INK", 217},       {"PAPER", 218},     {"FLASH", 219},     {"BRIGHT", 220},
+    {"INVERSE", 221},   {"OVER", 222},      {"OUT", 223},       {"LPRINT", 224},
+    {"LLIST", 225},     {"STOP", 226},      {"READ", 227},      {"DATA", 228},
+    {"RESTORE", 229},   {"NEW", 230},       {"BORDER", 231},    {"CONTINUE", 232},
+    {"DIM", 233},       {"REM", 234},       {"FOR", 235},       {"GO TO", 236},
+    {"GO SUB", 237},    {"INPUT", 238},     {"LOAD", 239},      {"LIST", 240},
+    {"LET", 241},       {"PAUSE", 242},     {"NEXT", 243},      {"POKE", 244},
+    {"PRINT", 245},     {"PLOT", 246},      {"RUN", 247},       {"SAVE", 248},
+    {"RANDOMIZE", 249}, {"RANDOMISE", 249}, {"IF", 250},        {"CLS", 251},
+    {"DRAW", 252},      {"CLEAR", 253},     {"RETURN", 254},    {"COPY", 255},
+    {NULL, 0}
+};
+
+#define SB_REM 234
+
+void sbNumber (double v, unsigned char *b)
+{
+    /* The 5 byte form of v. Whole numbers up to 65535 use the short integer
+     * form, the rest the floating point form (as on the ZX81).
+     */
+
+    double m;
+    unsigned long mant;
+    int e;
+
+    if (v >= 0 && v <= 65535 && v == floor(v))
+        {
+        b[0] = b[1] = b[4] = 0;
+        b[2] = (unsigned long)v & 255;
+        b[3] = (unsigned long)v >> 8;
+        return;
+        }
+    m = frexp(fabs(v), &e); /* 0.5 <= m < 1 */
+    m = floor(m * 4294967296.0 + 0.5);
+    if (m >= 4294967296.0)
+        {
+        m /= 2;
+        e++;
+        }
+    if (e + 128 < 1)
+        {
+        memset(b, 0, 5);
+        return;
+        }
+    if (e + 128 > 255)
+        {
+        e = 127;
+        m = 4294967295.0;
+        }
+    mant = (unsigned long)m;
+    b[0] = e + 128;
+    b[1] = ((mant >> 24) & 0x7F) | (v < 0 ? 0x80 : 0);
+    b[2] = (mant >> 16) & 255;
+    b[3] = (mant >> 8) & 255;
+    b[4] = mant & 255;
+}
+
+static int sbMatch (const char *s, const char *end, const char *word)
+{
+    /* Length of the text at s matching a keyword, or 0 */
+
+    const char *p = s;
+
+    for (; *word; word++)
+        {
+        if (*word == ' ')
+            {
+            while (p < end && *p == ' ')
+                p++;
+            continue;
+            }
+        if (p >= end || toupper((unsigned char)*p) != *word)
+            return 0;
+        p++;
+        }
+    /* A keyword ending in a letter can't run on into a name */
+    if (isalpha((unsigned char)word[-1]) && p < end && isalnum((unsigned char)*p))
+        return 0;
+    return p - s;
+}
+
+static int sbKeyword (const char *s, const char *end, int inName, int *token)
+{
+    /* The longest keyword at s, but only <= >= and <> in a name. Returns its
+     * length and sets *token, or 0.
+     */
+
+    const SBKEYWORD *k;
+    int n, best = 0;
+
+    for (k = sbKeywords; k->word; k++)
+        {
+        if (inName && isalpha((unsigned char)k->word[0]))
+            continue;
+        n = sbMatch(s, end, k->word);
+        if (n > best)
+            {
+            best = n;
+            *token = k->token;
+            }
+        }
+    return best;
+}
+
+static int sbBlock (char c)
+{
+    /* Pixel bits of one side of a block graphic escape, or -1 */
+
+    switch (c)
+        {
+        case ' ':   return 0;
+        case '\'':  return 1;  /* Top */
+        case '.':   return 2;  /* Bottom */
+        case ':':   return 3;  /* Both */
+        default:    return -1;
+        }
+}
+
+static int sbChar (const char *s, const char *end, unsigned char *c)
+{
+    /* The character code at s, with the zmakebas escapes.
+     * Returns how many characters of text it took.
+     */
+
+    int l, r, n;
+    const char *p;
+
+    if (*s != '\\' || s + 1 >= end)
+        {
+        *c = *s;
+        return 1;
+        }
+    if (s[1] == '{')
+        {
+        for (n = 0, p = s + 2; p < end && isdigit((unsigned char)*p); p++)
+            n = 10 * n + (*p - '0');
+        if (p < end && *p == '}' && p > s + 2)
+            {
+            *c = n;
+            return p + 1 - s;
+            }
+        }
+    else if (s[1] >= 'a' && s[1] <= 'u')
+        {
+        *c = 144 + (s[1] - 'a');   /* UDG */
+        return 2;
+        }
+    else if (s[1] == '\\')
+        {
+        *c = '\\';
+        return 2;
+        }
+    else if (s + 2 < end && (l = sbBlock(s[1])) >= 0 && (r = sbBlock(s[2])) >= 0)
+        {
+        /* Block graphic, with bits 1=top right, 2=top left, 4=bottom right,
+         * 8=bottom left
+         */
+        *c = 128 + ((l & 1) ? 2 : 0) + ((l & 2) ? 8 : 0)
+                 + ((r & 1) ? 1 : 0) + ((r & 2) ? 4 : 0);
+        return 3;
+        }
+    *c = '\\';
+    return 1;
+}
+
+static int sbLine (const char *s, const char *end, OUTBUF *prog)
+{
+    /* Tokenize the text of one line after its number to prog */
+
+    int inString = 0, inRem = 0, inName = 0, n, token;
+    unsigned char c, num[6];
+    const char *p;
+    char lit[40];
+
+    while (s < end)
+        {
+        if (inRem || inString)
+            {
+            if (*s == '"')
+                inString = !inString;
+            s += sbChar(s, end, &c);
+            obPutc(prog, (char)c);
+            continue;
+            }
+
+        if (*s == ' ' || *s == '\t')
+            {
+            inName = 0;
+            s++;
+            continue;
+            }
+        if (*s == '"')
+            {
+            inString = 1;
+            obPutc(prog, *s++);
+            continue;
+            }
+
+        /* A number, unless it's part of a name like A1 */
+        if ( (isdigit((unsigned char)*s) || (*s == '.' && s + 1 < end && isdigit((unsigned char)s[1])))
+             && !inName )
+            {
+            p = s;
+            while (p < end && isdigit((unsigned char)*p))
+                p++;
+            if (p < end && *p == '.')
+                for (p++; p < end && isdigit((unsigned char)*p); p++)
+                    ;
+            if (p < end && (*p == 'E' || *p == 'e'))
+                {
+                n = (p + 1 < end && (p[1] == '+' || p[1] == '-')) ? 2 : 1;
+                if (p + n < end && isdigit((unsigned char)p[n]))
+                    for (p += n; p < end && isdigit((unsigned char)*p); p++)
+                        ;
+                }
+            n = p - s;
+            if (n >= (int)sizeof(lit))
+                n = sizeof(lit) - 1;
+            memcpy(lit, s, n);
+            lit[n] = '\0';
+            obWrite(prog, s, p - s);
+            num[0] = SB_NUMBER;
+            sbNumber(strtod(lit, NULL), num + 1);
+            obWrite(prog, (char *)num, 6);
+            inName = 0;
+            s = p;
+            continue;
+            }
+
+        if ( (n = sbKeyword(s, end, inName, &token)) > 0 )
+            {
+            obPutc(prog, (char)token);
+            inName = 0;
+            s += n;
+            if (token == SB_REM)
+                {
+                inRem = 1;
+                if (s < end && *s == ' ')
+                    s++;
+                }
+            continue;
+            }
+
+        /* Anything else, with letters and digits making up a name */
+        inName = isalnum((unsigned char)*s);
+        s += sbChar(s, end, &c);
+        obPutc(prog, (char)c);
+        }
+    obPutc(prog, SB_ENTER);
+    return 0;
+}
+
+int sbTokenize (const char *text, size_t len, OUTBUF *prog)
+{
+    /* Tokenize the zmakebas text lines in text to the program in prog.
+     * Blank lines and lines starting with # are skipped.
+     * Returns 0 if OK, or -1 for a line without a line number.
+     */
+
+    const char *s = text, *end = text + len, *eol;
+    size_t head;
+    unsigned long linenum, linelen;
+
+    while (s < end)
+        {
+        eol = memchr(s, '\n', end - s);
+        if (eol == NULL)
+            eol = end;
+        while (s < eol && (*s == ' ' || *s == '\t'))
+            s++;
+        if (s < eol && eol[-1] == '\r')
+            eol--;
+        if (s == eol || *s == '#')
+            {
+            s = (eol < end && *eol == '\r') ? eol + 2 : eol + 1;
+            continue;
+            }
+        if (!isdigit((unsigned char)*s))
+            return -1;
+        for (linenum = 0; s < eol && isdigit((unsigned char)*s); s++)
+            linenum = 10 * linenum + (*s - '0');
+        if (linenum > 9999)
+            return -1;
+
+        obPutc(prog, (char)(linenum >> 8));
+        obPutc(prog, (char)(linenum & 255));
+        head = prog->len;
+        obWrite(prog, "\0\0", 2); /* Length, filled in below */
+        sbLine(s, eol, prog);
+        if (prog->error)
+            return -1;
+        linelen = prog->len - head - 2;
+        prog->buf[head] = linelen & 255;
+        prog->buf[head + 1] = linelen >> 8;
+
+        s = (eol < end && *eol == '\r') ? eol + 2 : eol + 1;
+        }
+    return 0;
+}
+
+int sbTapBlock (FILE *out, int flag, const unsigned char *data, size_t len)
+{
+    /* Write a tape block: length, flag, data, and the XOR check byte */
+
+    size_t f;
+    int chk = flag;
+
+    for (f = 0; f < len; f++)
+        chk ^= data[f];
+    fputc((len + 2) & 255, out);
+    fputc((len + 2) >> 8, out);
+    fputc(flag, out);
+    fwrite(data, 1, len, out);
+    fputc(chk, out);
+    return ferror(out) ? -1 : 0;
+}
+
+int sbTapFile (FILE *out, int type, const char *name, const unsigned char *data,
+               size_t len, unsigned param1, unsigned param2)
+{
+    /* Write a header and data block pair for a program (param1 = autostart
+     * line, param2 = length of the program without variables) or CODE
+     * (param1 = address, param2 = 32768).
+     * Returns 0 if OK, -1 for a write error.
+     */
+
+    unsigned char header[17];
+    size_t f, n = strlen(name);
+
+    header[0] = type;
+    for (f = 0; f < 10; f++)
+        header[f + 1] = f < n ? name[f] : ' '; /* Padded with spaces */
+    header[11] = len & 255;
+    header[12] = len >> 8;
+    header[13] = param1 & 255;
+    header[14] = param1 >> 8;
+    header[15] = param2 & 255;
+    header[16] = param2 >> 8;
+
+    if ( sbTapBlock(out, 0x00, header, sizeof(header)) != 0 )
+        return -1;
+    return sbTapBlock(out, 0xFF, data, len);
+}
+
+/* 48K snapshots
+ *
+ * The RAM is set up the way the ROM leaves it after NEW and a RUN typed as
+ * a command: the system variables, the channel table, a cleared screen, the
+ * program at PROG with no variables, and the machine stack holding the
+ * return to MAIN-4 (the report routine) under ERR_SP. The registers are set
+ * to go into the ROM's statement loop at STMT-R-1 with NEWPPC set to the
+ * line to run and NSPPC 0, as a GO TO leaves them, so the program starts at
+ * once with nothing loaded from tape. We have no ROM to copy the letters
+ * from, so the UDGs are blank unless given.
+ */
+
+#define SB_RAM      16384   /* Where the snapshot RAM starts */
+#define SB_RAMTOP   0xFF57
+#define SB_ERR_SP   0xFF54
+#define SB_CHANS    0x5CB6
+#define SB_STMT_R_1 0x1B7D  /* ROM statement loop, after the BREAK test */
+#define SB_MAIN_4   0x1303  /* ROM report routine, returned to by errors */
+
+#define SB_POKE(a, v) (ram[(a) - SB_RAM] = (unsigned char)(v))
+#define SB_POKE2(a, v) (SB_POKE(a, (v) & 255), SB_POKE((a) + 1, ((v) >> 8) & 255))
+
+static const unsigned char sbChanTable[] =
+    {
+    0xF4, 0x09, 0xA8, 0x10, 'K',    /* Keyboard and lower screen */
+    0xF4, 0x09, 0xC4, 0x15, 'S',    /* Upper screen */
+    0x81, 0x0F, 0xC4, 0x15, 'R',    /* Workspace */
+    0xF4, 0x09, 0xC4, 0x15, 'P',    /* Printer */
+    0x80
+    };
+
+static const unsigned char sbStreams[] =
+    {
+    0x01, 0x00, 0x06, 0x00, 0x0B, 0x00, 0x01, 0x00, 0x01, 0x00, 0x06, 0x00, 0x10, 0x00
+    };
+
+int sbMemory (unsigned char *ram, const unsigned char *prog, size_t len,
+              unsigned line, const unsigned char *udg, size_t udglen)
+{
+    /* Fill ram (SB_RAMSIZE bytes from 16384) for a snapshot that runs the
+     * program from line, with udglen bytes of UDGs from "a".
+     * Returns 0 if OK, -1 if the program is too big.
+     */
+
+    unsigned vars = SB_PROG + len, eline = vars + 1, worksp = eline + 2;
+
+    if ( worksp + SB_STACK > SB_ERR_SP || udglen > 21 * 8 )
+        return -1;
+    memset(ram, 0, SB_RAMSIZE);
+    memset(ram + 0x5800 - SB_RAM, 0x38, 768);   /* Black ink on white paper */
+
+    /* System variables that aren't 0 */
+    SB_POKE(23552, 0xFF);           /* KSTATE, both sets free */
+    SB_POKE(23556, 0xFF);
+    SB_POKE(23561, 35);             /* REPDEL */
+    SB_POKE(23562, 5);              /* REPPER */
+    memcpy(ram + 23568 - SB_RAM, sbStreams, sizeof(sbStreams));   /* STRMS */
+    SB_POKE2(23606, 0x3C00);        /* CHARS */
+    SB_POKE(23608, 0x40);           /* RASP */
+    SB_POKE(23610, 0xFF);           /* ERR_NR, no error */
+    SB_POKE(23611, 0xCC);           /* FLAGS, running a program */
+    SB_POKE2(23613, SB_ERR_SP);     /* ERR_SP */
+    SB_POKE2(23618, line);          /* NEWPPC */
+    SB_POKE(23620, 0);              /* NSPPC, so the jump to NEWPPC is taken */
+    SB_POKE2(23621, 0xFFFE);        /* PPC, the command line */
+    SB_POKE(23624, 0x38);           /* BORDCR */
+    SB_POKE2(23627, vars);          /* VARS */
+    SB_POKE2(23631, SB_CHANS);      /* CHANS */
+    SB_POKE2(23633, SB_CHANS);      /* CURCHL */
+    SB_POKE2(23635, SB_PROG);       /* PROG */
+    SB_POKE2(23637, SB_PROG);       /* NXTLIN */
+    SB_POKE2(23639, SB_PROG - 1);   /* DATADD, as after RESTORE */
+    SB_POKE2(23641, eline);         /* E_LINE */
+    SB_POKE2(23643, eline);         /* K_CUR */
+    SB_POKE2(23645, eline);         /* CH_ADD */
+    SB_POKE2(23649, worksp);        /* WORKSP */
+    SB_POKE2(23651, worksp);        /* STKBOT */
+    SB_POKE2(23653, worksp);        /* STKEND */
+    SB_POKE2(23656, 23698);         /* MEM, at MEMBOT */
+    SB_POKE(23659, 2);              /* DF_SZ */
+    SB_POKE2(23675, SB_UDGADDR);        /* UDG */
+    SB_POKE(23679, 33);             /* P_POSN */
+    SB_POKE2(23680, 0x5B00);        /* PR_CC */
+    SB_POKE2(23682, 0x1721);        /* ECHO_E */
+    SB_POKE2(23684, 0x4000);        /* DF_CC */
+    SB_POKE2(23686, 0x50E0);        /* DFCCL */
+    SB_POKE2(23688, 0x1821);        /* S_POSN */
+    SB_POKE2(23690, 0x1721);        /* SPOSNL */
+    SB_POKE(23692, 1);              /* SCR_CT */
+    SB_POKE(23693, 0x38);           /* ATTR_P */
+    SB_POKE(23695, 0x38);           /* ATTR_T */
+    SB_POKE2(23730, SB_RAMTOP);     /* RAMTOP */
+    SB_POKE2(23732, 0xFFFF);        /* P_RAMT */
+    memcpy(ram + SB_CHANS - SB_RAM, sbChanTable, sizeof(sbChanTable));
+
+    /* The program, no variables, and an empty edit line */
+    memcpy(ram + SB_PROG - SB_RAM, prog, len);
+    SB_POKE(vars, 0x80);
+    SB_POKE(eline, SB_ENTER);
+    SB_POKE(eline + 1, 0x80);
+
+    /* Machine stack: MAIN-4 under ERR_SP, then the GO SUB stack end marker */
+    SB_POKE2(SB_ERR_SP, SB_MAIN_4);
+    SB_POKE(SB_RAMTOP, 0x3E);
+
+    memcpy(ram + SB_UDGADDR - SB_RAM, udg, udglen);
+    return 0;
+}
+
+int sbSnaFile (FILE *out, const unsigned char *ram)
+{
+    /* Write a .sna: 27 bytes of registers then the RAM. The PC is taken off
+     * the stack by the emulator, so it's pushed below ERR_SP in a copy.
+     * Returns 0 if OK, -1 for a write error.
+     */
+
+    unsigned char h[27];
+    unsigned sp = SB_ERR_SP - 2;
+    unsigned char pc[2];
+
+    memset(h, 0, sizeof(h));
+    h[0] = 0x3F;                    /* I */
+    h[1] = 0x58;  h[2] = 0x27;      /* HL' = 0x2758, kept for the calculator */
+    h[15] = 0x3A; h[16] = 0x5C;     /* IY, the system variables */
+    h[19] = 0x04;                   /* IFF2, interrupts on */
+    h[23] = sp & 255;  h[24] = sp >> 8;
+    h[25] = 1;                      /* IM 1 */
+    h[26] = 7;                      /* White border */
+    pc[0] = SB_STMT_R_1 & 255;
+    pc[1] = SB_STMT_R_1 >> 8;
+
+    fwrite(h, 1, sizeof(h), out);
+    fwrite(ram, 1, sp - SB_RAM, out);
+    fwrite(pc, 1, 2, out);
+    fwrite(ram + sp + 2 - SB_RAM, 1, SB_RAMSIZE - (sp + 2 - SB_RAM), out);
+    return ferror(out) ? -1 : 0;
+}
+
+static void sbZ80Run (FILE *out, int b, int n)
+{
+    /* A run of n bytes b, compressed if it's worth it */
+
+    if ( n >= 5 || (b == 0xED && n >= 2) )
+        {
+        fputc(0xED, out);
+        fputc(0xED, out);
+        fputc(n, out);
+        fputc(b, out);
+        }
+    else
+        while (n--)
+            fputc(b, out);
+}
+
+int sbZ80File (FILE *out, const unsigned char *ram)
+{
+    /* Write a version 1 .z80: 30 bytes of registers then the RAM compressed
+     * with ED ED n b for runs of b, ending with 00 ED ED 00.
+     * Returns 0 if OK, -1 for a write error.
+     */
+
+    unsigned char h[30];
+    size_t f, n;
+
+    memset(h, 0, sizeof(h));
+    h[6] = SB_STMT_R_1 & 255;  h[7] = SB_STMT_R_1 >> 8;
+    h[8] = SB_ERR_SP & 255;    h[9] = SB_ERR_SP >> 8;
+    h[10] = 0x3F;                   /* I */
+    h[12] = (7 << 1) | 0x20;        /* White border, compressed */
+    h[19] = 0x58; h[20] = 0x27;     /* HL' = 0x2758, kept for the calculator */
+    h[23] = 0x3A; h[24] = 0x5C;     /* IY, the system variables */
+    h[27] = h[28] = 1;              /* IFF1, IFF2 */
+    h[29] = 1;                      /* IM 1 */
+    fwrite(h, 1, sizeof(h), out);
+
+    for (f = 0; f < SB_RAMSIZE; f += n)
+        {
+        for (n = 1; f + n < SB_RAMSIZE && n < 255 && ram[f + n] == ram[f]; n++)
+            ;
+        sbZ80Run(out, ram[f], (int)n);
+        if ( ram[f] == 0xED && n == 1 && f + 1 < SB_RAMSIZE )
+            {
+            /* The byte after a single ED can't start a block */
+            fputc(ram[f + 1], out);
+            n++;
+            }
+        }
+    fputc(0x00, out);
+    fputc(0xED, out);
+    fputc(0xED, out);
+    fputc(0x00, out);
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,53 @@
+/* specbas - make a ZX Spectrum BASIC program in memory and write it to tape
+ * By Ryan Gray
+ *
+ * sbTokenize() takes zmakebas style text, as made by p2speccy -z, and makes
+ * the tokenized program the way zmakebas does, so p2speccy can write a .tap
+ * file itself rather than going through a text file and zmakebas. Each line is
+ *
+ *   2 bytes  line number, high byte first
+ *   2 bytes  length of the text that follows, low byte first
+ *   n bytes  text, ending with ENTER (0x0D)
+ *
+ * with keywords as single byte tokens (165-255), and each number followed by
+ * 0x0E and its value in 5 bytes. Spaces are dropped except in strings and
+ * REMs. The zmakebas escapes are understood: \{n} for any code, \a to \u for
+ * the UDGs, \' \. \: and space pairs for the block graphics, and \\.
+ *
+ * sbMemory() makes the 48K RAM of a machine with the program loaded and about
+ * to run it, for sbSnaFile() or sbZ80File() to write as a snapshot.
+ */
+
+#ifndef SPECBAS_H
+#define SPECBAS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "outbuf.h"
+
+#define SB_ENTER    0x0D    /* End of line character */
+#define SB_NUMBER   0x0E    /* Marks the 5 byte number after a numeric literal */
+#define SB_NOAUTO   32768   /* Autostart line for a program that doesn't run */
+#define SB_UDGADDR  65368   /* USR "a" on a 48K machine */
+
+#define SB_PROG     23755   /* Start of the program with no Interface 1 */
+#define SB_RAMSIZE  49152   /* RAM in a 48K snapshot, from 16384 */
+#define SB_STACK    256     /* Room to leave for the calculator and machine stacks */
+
+#define SB_PROGRAM  0       /* .tap header types */
+#define SB_CODE     3
+
+void sbNumber (double v, unsigned char *b);
+int  sbTokenize (const char *text, size_t len, OUTBUF *prog);
+
+int  sbTapBlock (FILE *out, int flag, const unsigned char *data, size_t len);
+int  sbTapFile (FILE *out, int type, const char *name, const unsigned char *data,
+                size_t len, unsigned param1, unsigned param2);
+
+int  sbMemory (unsigned char *ram, const unsigned char *prog, size_t len,
+               unsigned line, const unsigned char *udg, size_t udglen);
+int  sbSnaFile (FILE *out, const unsigned char *ram);
+int  sbZ80File (FILE *out, const unsigned char *ram);
+
+#endif
@@ -0,0 +1,32 @@
+   1 REM \' C#TAN 
+   2 GO SUB 173: REM Grey UDGs
+  10 REM TEST BASIC PROGRAM FOR P2SPECTRUM
+  11 REM THE CALL TO THE GREY UDG LOADER SHOULD BE INSERTED AT LINE 2 ABOVE
+  20 REM THE PLOT 4X SUBROUTINE SHOULD APPEAR AT LINE 171
+  21 REM THE UNPLOT 4X ROUTINE SHOULD APPEAR AT LINE 172
+  30 CLS
+  50 PRINT AT VAL "12",NOT PI;"\{20}\{1}A\{20}\{0} \{20}\{1}B\{20}\{0} \{20}\{1}C\{20}\{0} \{20}\{1}D\{20}\{0} \{20}\{1}E\{20}\{0} \{20}\{1}F\{20}\{0}"
+  60 POKE 23692,255: PRINT AT 21,0'': REM SCROLL
+  70 PRINT AT VAL "12",NOT PI;"\a \b \c \d \e \f"
+  71 REM UDG LOADER SHOULD BE INSERTED AT LINE 173
+  80 REM POKE 16516,65: REM POKE disabled! << WARNING **
+  81 LET X=PEEK VAL "16514": REM PEEK used! << WARNING **
+  90 LET C$=CHR$ VAL "12": REM CHR$ used << WARNING **
+ 100 LET K$=INKEY$ : REM  INKEY$ used << WARNING ** You may need to change key comparisons to lowercase with K$.
+ 110 LET C=CODE C$: REM CODE used << WARNING **
+ 120 LET A$="QUOTE IMAGE: """
+ 130 LET Y=VAL "3"^VAL "2"
+ 140 PLOT 4*(CODE " "),4*(VAL "11"): GO SUB 171: REM PLOT 4x
+ 141 PLOT 4*(CODE "!"),4*(VAL "10"): GO SUB 171: REM PLOT 4x
+ 142 PLOT INVERSE 1;4*(CODE " "),4*(VAL "11"): GO SUB 172: REM UNPLOT 4x
+ 150 LET R=INT INT VAL "16514": REM USR disabled as INT INT! << WARNING **
+ 160 PRINT "RESULT=";R
+ 170 STOP
+ 171 DRAW 3,0: DRAW 0,3: DRAW -3,0: DRAW 0,-2: DRAW 2,0: DRAW 0,1: DRAW -1,0: RETURN: REM Plot 4x pixel
+ 172 DRAW INVERSE 1;3,0: DRAW INVERSE 1;0,3: DRAW INVERSE 1;-3,0: DRAW INVERSE 1;0,-2: DRAW INVERSE 1;2,0: DRAW INVERSE 1;0,1: DRAW INVERSE 1;-1,0: RETURN: REM Unplot 4x pixel
+ 173 RESTORE 176: LET U=USR "a": REM Init grey UDGs
+ 174 FOR A=0 TO 47 STEP 4: READ B,C
+ 175 POKE U+A,B: POKE U+A+1,C: POKE U+A+2,B: POKE U+A+3,C: NEXT A: RETURN
+ 176 DATA 170,85,170,85,170,85,0,0,0,0,170,85,85,170,255,255,255,255,85,170,85,170,85,170
+ 200 SAVE "TEST2" LINE 201
+ 210 RUN 
@@ -0,0 +1,36 @@
+   1 CLEAR 65167: RESTORE 11: FOR a=65168 TO 65185: READ b: POKE a,b: NEXT a: FOR a=65186 TO 65361 STEP 7: POKE a,205: POKE a+1,144: POKE a+2,254: FOR b=3 TO 6: POKE a+b,0: NEXT b: NEXT a: GO SUB 5: REM Grey UDGs
+   2 GO TO 20
+   3 DRAW 3,0: DRAW 0,3: DRAW -3,0: DRAW 0,-2: DRAW 2,0: DRAW 0,1: DRAW -1,0: RETURN: REM Plot 4x pixel
+   4 DRAW INVERSE 1;3,0: DRAW INVERSE 1;0,3: DRAW INVERSE 1;-3,0: DRAW INVERSE 1;0,-2: DRAW INVERSE 1;2,0: DRAW INVERSE 1;0,1: DRAW INVERSE 1;-1,0: RETURN: REM Unplot 4x pixel
+   5 RESTORE 8: LET U=USR "a": REM Init grey UDGs
+   6 FOR A=0 TO 47 STEP 4: READ B,C
+   7 POKE U+A,B: POKE U+A+1,C: POKE U+A+2,B: POKE U+A+3,C: NEXT A: RETURN
+   8 DATA 170,85,170,85,170,85,0,0,0,0,170,85,85,170,255,255,255,255,85,170,85,170,85,170
+   9 PRINT "Line","Hits": FOR a=65186 TO 65361 STEP 7: IF PEEK (a+3)+PEEK (a+4) THEN PRINT PEEK (a+5)+256*PEEK (a+6),PEEK (a+3)+256*PEEK (a+4)
+  10 NEXT a: STOP: REM Profile
+  11 DATA 225,52,35,32,1,52,35,237,91,69,92,115,35,114,1,0,0,201
+  20 POKE 23728,USR 65186: REM \' C#TAN 
+  30 POKE 23728,USR 65193: REM TEST BASIC PROGRAM FOR P2SPECTRUM
+  40 POKE 23728,USR 65200: REM THE CALL TO THE GREY UDG LOADER SHOULD BE INSERTED AT LINE 2 ABOVE
+  50 POKE 23728,USR 65207: REM THE PLOT 4X SUBROUTINE SHOULD APPEAR AT LINE 171
+  60 POKE 23728,USR 65214: REM THE UNPLOT 4X ROUTINE SHOULD APPEAR AT LINE 172
+  70 POKE 23728,USR 65221: CLS
+  90 POKE 23728,USR 65228: PRINT AT 12,0;"\{20}\{1}A\{20}\{0} \{20}\{1}B\{20}\{0} \{20}\{1}C\{20}\{0} \{20}\{1}D\{20}\{0} \{20}\{1}E\{20}\{0} \{20}\{1}F\{20}\{0}"
+ 100 POKE 23728,USR 65235: POKE 23692,255: PRINT AT 21,0'': REM SCROLL
+ 110 POKE 23728,USR 65242: PRINT AT 12,0;"\a \b \c \d \e \f"
+ 120 POKE 23728,USR 65249: REM UDG LOADER SHOULD BE INSERTED AT LINE 173
+ 130 POKE 23728,USR 65256: REM POKE 16516,65: REM POKE disabled! << WARNING **
+ 140 POKE 23728,USR 65263: LET X=PEEK 16514: REM PEEK used! << WARNING **
+ 150 POKE 23728,USR 65270: LET C$=CHR$ 12: REM CHR$ used << WARNING **
+ 160 POKE 23728,USR 65277: LET K$=INKEY$ : REM  INKEY$ used << WARNING ** You may need to change key comparisons to lowercase with K$.
+ 170 POKE 23728,USR 65284: LET C=CODE C$: REM CODE used << WARNING **
+ 180 POKE 23728,USR 65291: LET A$="QUOTE IMAGE: """
+ 190 POKE 23728,USR 65298: LET Y=3^2
+ 200 POKE 23728,USR 65305: PLOT 4*(32),4*(11): GO SUB 3: REM PLOT 4x
+ 210 POKE 23728,USR 65312: PLOT 4*(33),4*(10): GO SUB 3: REM PLOT 4x
+ 220 POKE 23728,USR 65319: PLOT INVERSE 1;4*(32),4*(11): GO SUB 4: REM UNPLOT 4x
+ 230 POKE 23728,USR 65326: LET R=INT INT 16514: REM USR disabled as INT INT! << WARNING **
+ 240 POKE 23728,USR 65333: PRINT "RESULT=";R
+ 250 POKE 23728,USR 65340: STOP
+ 260 POKE 23728,USR 65347: SAVE "TEST2" LINE 1
+ 270 POKE 23728,USR 65354: RUN 
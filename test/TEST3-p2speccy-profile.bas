@@ -0,0 +1,11 @@
+   1 CLEAR 65328: RESTORE 29: FOR a=65329 TO 65346: READ b: POKE a,b: NEXT a: FOR a=65347 TO 65361 STEP 7: POKE a,205: POKE a+1,49: POKE a+2,255: FOR b=3 TO 6: POKE a+b,0: NEXT b: NEXT a: GO SUB 23: REM Grey UDGs
+  10 POKE 23728,USR 65347: PRINT "\a\b\d"
+  20 POKE 23728,USR 65354: GO TO 10
+  23 RESTORE 26: LET U=USR "a": REM Init grey UDGs
+  24 FOR A=0 TO 47 STEP 4: READ B,C
+  25 POKE U+A,B: POKE U+A+1,C: POKE U+A+2,B: POKE U+A+3,C: NEXT A: RETURN
+  26 DATA 170,85,170,85,170,85,0,0,0,0,170,85,85,170,255,255,255,255,85,170,85,170,85,170
+  27 PRINT "Line","Hits": FOR a=65347 TO 65361 STEP 7: IF PEEK (a+3)+PEEK (a+4) THEN PRINT PEEK (a+5)+256*PEEK (a+6),PEEK (a+3)+256*PEEK (a+4)
+  28 NEXT a: STOP: REM Profile
+  29 DATA 225,52,35,32,1,52,35,237,91,69,92,115,35,114,1,0,0,201
+  30 POKE 23728,USR 65361: STOP
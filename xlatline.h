@@ -0,0 +1,71 @@
+/* xlatline.h - template for the per-style line translators in p2txt
+ *
+ * This is included once for each variant with these defined:
+ *
+ *   XLAT_NAME  Name of the function to make
+ *   XLAT_ESC   0        No escapes
+ *              XC_ESCZ  Zmakebas \{n} codes in REMs and quotes
+ *              XC_ESCH  ZXText2P \XX codes in a REM
+ *
+ * so each variant only has the tests it needs in its inner loop, and the
+ * output style is settled once per file rather than per character. Output is
+ * the same as the generic xlatline().
+ */
+
+#if XLAT_ESC == XC_ESCZ
+#define XLAT_PUTESC(x) obWrite(ob, (x)->escz, (x)->esczlen)
+#elif XLAT_ESC == XC_ESCH
+#define XLAT_PUTESC(x) obWrite(ob, (x)->esch, 3)
+#endif
+
+void XLAT_NAME (OUTBUF *ob, const unsigned char *text, int linelen, int inFirstLineREM)
+{
+int f;
+unsigned char c;
+const XCHAR *x;
+#if XLAT_ESC == XC_ESCZ
+int inQuotes = 0;
+#endif
+
+if (linelen > 0 && text[0] == REM_code)
+    {
+    /* The keyword then the REM text, which has no numbers or quotes */
+    obWrite(ob, xchars[REM_code].s, xchars[REM_code].len);
+    for (f = 1; f < linelen - 1; f++)
+        {
+        x = &xchars[text[f]];
+#if XLAT_ESC
+        if (x->flags & XLAT_ESC)
+            XLAT_PUTESC(x);
+        else
+#endif
+            obWrite(ob, x->s, x->len);
+        }
+    }
+else
+    {
+    for (f = 0; f < linelen - 1; f++)
+        {
+        c = text[f];
+        x = &xchars[c];
+        if (c == NUM_code)
+            {
+            f += 5; /* avoid inline FP numbers */
+            continue;
+            }
+#if XLAT_ESC == XC_ESCZ
+        if (c == QUOTE_code)
+            inQuotes = !inQuotes;
+        if (inQuotes && (x->flags & XC_ESCZ))
+            XLAT_PUTESC(x);
+        else
+#endif
+            obWrite(ob, x->s, x->len);
+        }
+    }
+obPutc(ob, '\n');
+}
+
+#undef XLAT_PUTESC
+#undef XLAT_NAME
+#undef XLAT_ESC